@@ -2,7 +2,13 @@
 
 uniform mat4 projection;
 
-layout(location = 0) in vec3 world_position;
+// The positions are stored as position_offset + position * position_scale,
+// which lets compact vertices store them relative to their chunk (full vertices use an offset of 0 and a scale of 1)
+uniform vec3 position_offset;
+uniform float position_scale;
+uniform bool octahedral_normals; // Compact vertices store the normal octahedral encoded in normal.xy
+
+layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
 
 out VS_OUT {
@@ -11,11 +17,22 @@ out VS_OUT {
     vec3 normal;
 } vs_out;
 
+vec3 octahedral_decode(vec2 encoded) {
+    vec3 n = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    if (n.z < 0.0) {
+        // Unfold the lower half of the octahedron
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
+
 void main() {
 
+    vec3 world_position = position_offset + position * position_scale;
+
     vs_out.world_position = world_position;
     vs_out.world_y = world_position.y;
-    vs_out.normal = normal;
+    vs_out.normal = octahedral_normals ? octahedral_decode(normal.xy) : normal;
 
     gl_Position = projection * vec4(world_position, 1.0);
-};
\ No newline at end of file
+};
@@ -0,0 +1,292 @@
+#include "ComputeMesher.h"
+#include "core/Log.h"
+
+#include <algorithm>
+
+namespace {
+	// The work group size of MarchingCubes.comp
+	const glm::ivec3 CUBE_GROUP_SIZE = glm::ivec3(8, 8, 4);
+
+	const GLintptr DRAW_COMMAND_OFFSET = 4 * sizeof(GLuint); // Where the indirect draw command starts in the draw buffer
+}
+
+ComputeMesher::ComputeMesher(const Programs* programs, const int* triCountTable, const int* triTable)
+	: programs(programs), densityTexture(0), tableBuffer(0), cubeVertexBuffer(0), vertexBuffer(0), drawBuffer(0), vao(0), generatedFence(nullptr),
+	dimensions(0), vertexCapacity(0), densitiesChanged(true), changedMin(0), changedMax(0), meshChanged(true)
+{
+	tables.assign(triCountTable, triCountTable + 256);
+	tables.insert(tables.end(), triTable, triTable + 256 * 16);
+}
+
+ComputeMesher::~ComputeMesher() {
+	release();
+}
+
+bool ComputeMesher::isSupported() {
+	return GLAD_GL_VERSION_4_3 != 0;
+}
+
+bool ComputeMesher::isAvailable() const {
+	return isSupported() && programs && programs->marchingCubes != 0u && programs->scan != 0u;
+}
+
+void ComputeMesher::invalidate(glm::ivec3 voxelMin, glm::ivec3 voxelMax) {
+	if (voxelMin.x >= voxelMax.x || voxelMin.y >= voxelMax.y || voxelMin.z >= voxelMax.z) return;
+
+	if (densitiesChanged) {
+		changedMin = glm::min(changedMin, voxelMin);
+		changedMax = glm::max(changedMax, voxelMax);
+	}
+	else {
+		changedMin = voxelMin;
+		changedMax = voxelMax;
+	}
+	densitiesChanged = true;
+	meshChanged = true;
+}
+
+void ComputeMesher::invalidateMesh() {
+	meshChanged = true;
+}
+
+void ComputeMesher::update(const TerrainGrid* grid, float isoLevel, bool gradientNormals) {
+	if (!isAvailable()) return;
+
+	glm::ivec3 gridDimensions = grid->getDimensions();
+	if (gridDimensions != dimensions || densityTexture == 0) {
+		createObjects(gridDimensions);
+		changedMin = glm::ivec3(0);
+		changedMax = gridDimensions;
+		densitiesChanged = true;
+		meshChanged = true;
+	}
+	if (dimensions.x < 2 || dimensions.y < 2 || dimensions.z < 2) return; // No cubes
+
+	readRequiredVertices();
+
+	if (densitiesChanged) {
+		uploadDensities(grid, glm::max(changedMin, glm::ivec3(0)), glm::min(changedMax, dimensions));
+		densitiesChanged = false;
+	}
+	if (meshChanged) {
+		generate(isoLevel, grid->getScale(), gradientNormals);
+		meshChanged = false;
+	}
+}
+
+void ComputeMesher::draw() const {
+	if (vao == 0) return;
+
+	glBindVertexArray(vao);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawBuffer);
+	glDrawArraysIndirect(GL_TRIANGLES, reinterpret_cast<const void*>(DRAW_COMMAND_OFFSET));
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+void ComputeMesher::release() {
+	if (generatedFence) {
+		glDeleteSync(generatedFence);
+		generatedFence = nullptr;
+	}
+	glDeleteTextures(1, &densityTexture);
+	glDeleteBuffers(1, &tableBuffer);
+	glDeleteBuffers(1, &cubeVertexBuffer);
+	if (!scanBuffers.empty()) {
+		glDeleteBuffers(static_cast<GLsizei>(scanBuffers.size()), scanBuffers.data());
+	}
+	glDeleteBuffers(1, &vertexBuffer);
+	glDeleteBuffers(1, &drawBuffer);
+	glDeleteVertexArrays(1, &vao);
+
+	densityTexture = tableBuffer = cubeVertexBuffer = vertexBuffer = drawBuffer = vao = 0;
+	scanBuffers.clear();
+	scanCounts.clear();
+	dimensions = glm::ivec3(0);
+	vertexCapacity = 0;
+}
+
+void ComputeMesher::createObjects(glm::ivec3 newDimensions) {
+	release();
+	dimensions = newDimensions;
+	if (dimensions.x < 2 || dimensions.y < 2 || dimensions.z < 2) return;
+
+	glGenTextures(1, &densityTexture);
+	glBindTexture(GL_TEXTURE_3D, densityTexture);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, dimensions.x, dimensions.y, dimensions.z, 0, GL_RED, GL_FLOAT, nullptr);
+	// The shader only uses texelFetch, but without mipmaps the texture has to filter without them to be complete
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, 0);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	glGenBuffers(1, &tableBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, tableBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, tables.size() * sizeof(int), tables.data(), GL_STATIC_DRAW);
+
+	// The prefix sum needs a level of block sums for every factor of SCAN_BLOCK_SIZE in the amount of cubes
+	glm::ivec3 cubeCounts = dimensions - glm::ivec3(1);
+	scanCounts.push_back(static_cast<GLuint>(cubeCounts.x * cubeCounts.y * cubeCounts.z));
+	while (scanCounts.back() > static_cast<GLuint>(SCAN_BLOCK_SIZE)) {
+		scanCounts.push_back((scanCounts.back() + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE);
+	}
+
+	glGenBuffers(1, &cubeVertexBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cubeVertexBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, scanCounts[0] * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+
+	scanBuffers.resize(scanCounts.size() - 1);
+	if (!scanBuffers.empty()) {
+		glGenBuffers(static_cast<GLsizei>(scanBuffers.size()), scanBuffers.data());
+	}
+	for (size_t level = 0; level < scanBuffers.size(); level++) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, scanBuffers[level]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, scanCounts[level + 1] * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+	}
+
+	// The required vertex count, padding, and then the count, instance count, first vertex and base instance of the draw command
+	const GLuint drawData[8] = { 0, 0, 0, 0, 0, 1, 0, 0 };
+	glGenBuffers(1, &drawBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(drawData), drawData, GL_DYNAMIC_COPY);
+
+	// Start with room for a few layers of surface over the whole terrain, readRequiredVertices() grows it if the mesh needs more
+	vertexCapacity = static_cast<GLuint>(16 * dimensions.x * dimensions.z);
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, vertexCapacity * 6 * sizeof(float), nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	// Set up the VAO, in the full vertex format of TerrainMesh.
+	// The vertex buffer keeps its name when it grows, so the VAO stays valid.
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+
+	// position at layout = 0
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), reinterpret_cast<const void*>(0));
+	glEnableVertexAttribArray(0);
+
+	// normal at layout = 1
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), reinterpret_cast<const void*>(3 * sizeof(float)));
+	glEnableVertexAttribArray(1);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void ComputeMesher::uploadDensities(const TerrainGrid* grid, glm::ivec3 voxelMin, glm::ivec3 voxelMax) {
+	glm::ivec3 size = voxelMax - voxelMin;
+	if (size.x <= 0 || size.y <= 0 || size.z <= 0) return;
+
+	std::vector<float> densities(size.x * size.y * size.z);
+	for (int z = 0; z < size.z; z++) {
+		for (int y = 0; y < size.y; y++) {
+			grid->getRow(voxelMin + glm::ivec3(0, y, z), size.x, &densities[(z * size.y + y) * size.x]);
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_3D, densityTexture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, voxelMin.x, voxelMin.y, voxelMin.z, size.x, size.y, size.z, GL_RED, GL_FLOAT, densities.data());
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void ComputeMesher::generate(float isoLevel, float scale, bool gradientNormals) {
+	glm::ivec3 cubeCounts = dimensions - glm::ivec3(1);
+	glm::ivec3 groups = (cubeCounts + CUBE_GROUP_SIZE - glm::ivec3(1)) / CUBE_GROUP_SIZE;
+
+	GLuint program = programs->marchingCubes;
+	glUseProgram(program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_3D, densityTexture);
+	glUniform1i(glGetUniformLocation(program, "densities"), 0);
+	glUniform3i(glGetUniformLocation(program, "dimensions"), dimensions.x, dimensions.y, dimensions.z);
+	glUniform1f(glGetUniformLocation(program, "iso_level"), isoLevel);
+	glUniform1f(glGetUniformLocation(program, "scale"), scale);
+	glUniform1i(glGetUniformLocation(program, "gradient_normals"), gradientNormals ? 1 : 0);
+	glUniform1ui(glGetUniformLocation(program, "vertex_capacity"), vertexCapacity);
+	bindMarchingCubesBuffers();
+
+	// First pass: the vertex count of every cube
+	glUniform1i(glGetUniformLocation(program, "generate_vertices"), 0);
+	glDispatchCompute(groups.x, groups.y, groups.z);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// Turn the counts into the first vertex of every cube, one level of block sums at a time.
+	// The sum of the last level is the vertex count of the whole mesh, which goes straight to the draw buffer.
+	for (size_t level = 0; level < scanCounts.size(); level++) {
+		GLuint values = level == 0 ? cubeVertexBuffer : scanBuffers[level - 1];
+		GLuint blockSums = level < scanBuffers.size() ? scanBuffers[level] : drawBuffer;
+		scan(values, blockSums, scanCounts[level], false);
+	}
+	for (size_t level = scanBuffers.size(); level-- > 0;) {
+		scan(level == 0 ? cubeVertexBuffer : scanBuffers[level - 1], scanBuffers[level], scanCounts[level], true);
+	}
+
+	// Second pass: every cube writes its vertices, and the draw command gets its vertex count
+	// The uniforms stay with the program, but the prefix sum used the same buffer bindings
+	glUseProgram(program);
+	bindMarchingCubesBuffers();
+	glUniform1i(glGetUniformLocation(program, "generate_vertices"), 1);
+	glDispatchCompute(groups.x, groups.y, groups.z);
+	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	for (GLuint binding = 0; binding < 4; binding++) {
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+	glBindTexture(GL_TEXTURE_3D, 0);
+	glUseProgram(0);
+
+	// The vertex count is read once the GPU got here, see readRequiredVertices()
+	if (generatedFence) {
+		glDeleteSync(generatedFence);
+	}
+	generatedFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void ComputeMesher::bindMarchingCubesBuffers() const {
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, cubeVertexBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, tableBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, vertexBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, drawBuffer);
+}
+
+void ComputeMesher::scan(GLuint values, GLuint blockSums, GLuint count, bool addBlockSums) {
+	GLuint program = programs->scan;
+	glUseProgram(program);
+	glUniform1ui(glGetUniformLocation(program, "value_count"), count);
+	glUniform1i(glGetUniformLocation(program, "add_block_sums"), addBlockSums ? 1 : 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, values);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, blockSums);
+
+	// There can be more blocks than work groups along a single axis, so spread them over a second one
+	GLuint blocks = (count + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE;
+	GLuint groupsX = std::min(blocks, 65535u);
+	glDispatchCompute(groupsX, (blocks + groupsX - 1) / groupsX, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void ComputeMesher::readRequiredVertices() {
+	if (!generatedFence) return;
+
+	// Never wait for the GPU, just try again next frame
+	GLenum status = glClientWaitSync(generatedFence, 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return;
+	glDeleteSync(generatedFence);
+	generatedFence = nullptr;
+
+	GLuint requiredVertices = 0;
+	glBindBuffer(GL_COPY_READ_BUFFER, drawBuffer);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(GLuint), &requiredVertices);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	if (requiredVertices <= vertexCapacity) return;
+
+	// The mesh was drawn without the cubes that did not fit, so make room with some headroom for sculpting and generate it again
+	vertexCapacity = requiredVertices + requiredVertices / 2;
+	LogInfo("Growing the compute mesh vertex buffer to %u vertices", vertexCapacity);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, vertexBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(vertexCapacity) * 6 * sizeof(float), nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	meshChanged = true;
+}
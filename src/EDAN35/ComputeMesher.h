@@ -0,0 +1,71 @@
+#pragma once
+
+#include "TerrainGrid.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+
+/// Generates the marching cubes mesh of a TerrainGrid in compute shaders, as an alternative to the CPU mesher of TerrainMesh.
+///
+/// The grid is kept in a 3D texture, of which only the changed voxels are uploaded again after a sculpt.
+/// MarchingCubes.comp then counts the vertices of every cube, MarchingCubesScan.comp turns the counts into the offset of every cube's vertices,
+/// and MarchingCubes.comp writes the vertices at those offsets. The vertex count ends up in an indirect draw command,
+/// so the mesh goes from the grid to the screen without anything being read back.
+/// The only thing read back is the vertex count, a frame or more later, to grow the vertex buffer when the mesh outgrew it.
+///
+/// The mesh is not indexed and uses the full vertex format of TerrainMesh. Needs OpenGL 4.3.
+///
+class ComputeMesher {
+public:
+	// The compute programs, registered with the ShaderProgramManager so that they are reloaded together with the other shaders
+	struct Programs {
+		GLuint marchingCubes = 0u; // common/MarchingCubes.comp
+		GLuint scan = 0u; // common/MarchingCubesScan.comp
+	};
+
+	// The tables are the triangle counts and triangles of every cube index, as in TerrainMesh
+	ComputeMesher(const Programs* programs, const int* triCountTable, const int* triTable);
+	~ComputeMesher();
+
+	static bool isSupported(); // Whether the OpenGL context has everything needed
+	bool isAvailable() const; // Whether the context is supported and the programs compiled
+
+	void invalidate(glm::ivec3 voxelMin, glm::ivec3 voxelMax); // The voxels [voxelMin, voxelMax) changed, so upload them again and regenerate the mesh
+	void invalidateMesh(); // Regenerates the mesh from the same voxels, e.g. for another iso level
+	// Uploads the changed voxels and regenerates the mesh if anything changed since the last update.
+	// Called every frame, as it also checks whether the mesh outgrew the vertex buffer.
+	void update(const TerrainGrid* grid, float isoLevel, bool gradientNormals);
+	void draw() const; // Draws the mesh with the currently used program
+	void release(); // Deletes all buffers and textures, they are created again by the next update
+
+	static const int SCAN_BLOCK_SIZE = 1024; // The amount of values MarchingCubesScan.comp sums per work group
+
+private:
+	void createObjects(glm::ivec3 dimensions); // (Re)creates the texture and buffers for a grid of the given dimensions
+	void uploadDensities(const TerrainGrid* grid, glm::ivec3 voxelMin, glm::ivec3 voxelMax);
+	void generate(float isoLevel, float scale, bool gradientNormals);
+	void bindMarchingCubesBuffers() const; // Binds the buffers to the bindings MarchingCubes.comp uses
+	void scan(GLuint values, GLuint blockSums, GLuint count, bool addBlockSums);
+	void readRequiredVertices(); // Grows the vertex buffer if the last generated mesh did not fit
+
+	const Programs* programs;
+	std::vector<int> tables; // The triangle counts followed by the triangle table, as uploaded to the table buffer
+
+	GLuint densityTexture;
+	GLuint tableBuffer;
+	GLuint cubeVertexBuffer; // The vertex count and then the first vertex of every cube
+	std::vector<GLuint> scanBuffers; // The block sums of every level of the prefix sum, except the last one which goes to the draw command
+	std::vector<GLuint> scanCounts; // The amount of values of every level of the prefix sum, starting with the cubes
+	GLuint vertexBuffer;
+	GLuint drawBuffer; // The vertex count the mesh needs, followed by the indirect draw command
+	GLuint vao;
+	GLsync generatedFence; // Passes once the last generated mesh is done, so its vertex count can be read without waiting
+
+	glm::ivec3 dimensions; // The grid dimensions the objects were created for
+	GLuint vertexCapacity; // The amount of vertices that fit in the vertex buffer
+	bool densitiesChanged;
+	glm::ivec3 changedMin, changedMax; // The voxels to upload again
+	bool meshChanged;
+};
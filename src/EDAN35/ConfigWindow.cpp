@@ -1,12 +1,16 @@
 #include "ConfigWindow.h"
 
 #include <imgui.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
 #include "core/Bonobo.h"
 
-Config::Config(TerrainGrid* grid, DebugPointsRenderer* debugPointRenderer, TerrainMesh* mesh) {
+Config::Config(TerrainGrid* grid, DebugPointsRenderer* debugPointRenderer, TerrainMesh* mesh, SculptHistory* history) {
 	terrain = grid;
 	this->debugPointRenderer = debugPointRenderer;
 	this->mesh = mesh;
+	this->history = history;
 
 	//!terrainMesh->setisoLevel(0.0f);
 
@@ -14,9 +18,11 @@ Config::Config(TerrainGrid* grid, DebugPointsRenderer* debugPointRenderer, Terra
 	// Get the current values of the terrain
 	terrain_dimensions = grid->getDimensions();
 	terrain_scale = grid->getScale();
+	terrain_precision = static_cast<int>(grid->getPrecision());
 
 	sculpter_size = 10.0f;
 	sculpter_strength = 0.2f;
+	sculpter_history_limit = history->getMemoryLimit() / (1024.0f * 1024.0f);
 
 	pd_show_points_debugger = false; // pd_ = points_debugger_
 	pd_point_size = 20.0f;
@@ -26,6 +32,18 @@ Config::Config(TerrainGrid* grid, DebugPointsRenderer* debugPointRenderer, Terra
 
 	md_show_terrain_mesh = true; // md_ = mesh_debugger_
 	md_iso_level = mesh->getIsoLevel();
+	md_algorithm = static_cast<int>(mesh->getAlgorithm());
+	md_worker_count = mesh->getWorkerCount();
+	md_indexed = mesh->getIndexed();
+	md_normal_mode = static_cast<int>(mesh->getNormalMode());
+	md_mapped_upload = mesh->getMappedUpload();
+	md_vertex_format = static_cast<int>(mesh->getVertexFormat());
+	md_lod_distance = mesh->getLodDistance();
+	md_simplification_error = mesh->getSimplificationError();
+	md_simplification_delay = mesh->getSimplificationDelay();
+	md_optimize_vertex_cache = mesh->getOptimizeVertexCache();
+	md_compute_meshing = mesh->getComputeMeshing();
+	std::snprintf(md_export_path, sizeof(md_export_path), "terrain");
 
 	show_sculpting_rays = false;
 	crosshair_size = 4.0f;
@@ -52,6 +70,12 @@ void Config::draw_config() {
 			terrain->resize(max(terrain_dimensions, glm::ivec3(1)));
 		}
 
+		const char* precisions[] = { "Float (32 bit)", "Fixed point (16 bit)", "Fixed point (8 bit)" }; // In the order of TerrainGrid::Precision
+		if (ImGui::Combo("Voxel precision", &terrain_precision, precisions, IM_ARRAYSIZE(precisions))) {
+			terrain->setPrecision(static_cast<TerrainGrid::Precision>(terrain_precision));
+		}
+		ImGui::Text("Voxel memory: %.1f MB (%zu bricks with their own voxels)", terrain->getMemoryUsage() / (1024.0 * 1024.0), terrain->getAllocatedBrickCount());
+
 		if (ImGui::SliderFloat("Terrain Scale", &terrain_scale, 0.0f, 10.0f)) {
 			terrain->setScale(terrain_scale);
 		}
@@ -67,6 +91,19 @@ void Config::draw_config() {
 		ImGui::SliderFloat("Sculpting Brush Size", &sculpter_size, 1.0f, 20.0f);
 		ImGui::SliderFloat("Sculpting Strength", &sculpter_strength, 0.01f, 1.0f);
 
+		ImGui::Text("Use U/R to undo/redo a sculpting stroke");
+		if (ImGui::Button("Undo")) {
+			history->undo();
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Redo")) {
+			history->redo();
+		}
+		ImGui::Text("History: %zu undo steps, %zu redo steps, %.2f MB", history->getUndoCount(), history->getRedoCount(), history->getMemoryUsage() / (1024.0 * 1024.0));
+		if (ImGui::SliderFloat("History memory limit (MB)", &sculpter_history_limit, 0.0f, 64.0f)) {
+			history->setMemoryLimit(static_cast<size_t>(sculpter_history_limit * 1024.0f * 1024.0f));
+		}
+
 		ImGui::Separator();
 
 		// Add UI to change the seed and scale
@@ -131,6 +168,82 @@ void Config::draw_config() {
 		if (&md_show_terrain_mesh) {
 			ImGui::SliderFloat("Iso Level", &md_iso_level, 0.001f, 1.0f);
 			mesh->setIsoLevel(md_iso_level);
+			const char* algorithms[] = { "Marching cubes", "Surface nets" }; // In the order of TerrainMesh::Algorithm
+			if (ImGui::Combo("Meshing algorithm", &md_algorithm, algorithms, IM_ARRAYSIZE(algorithms))) {
+				mesh->setAlgorithm(static_cast<TerrainMesh::Algorithm>(md_algorithm));
+			}
+			if (ImGui::SliderInt("Meshing threads", &md_worker_count, 1, WorkerPool::getMaxWorkerCount())) {
+				mesh->setWorkerCount(md_worker_count);
+			}
+			if (ImGui::Checkbox("Indexed mesh (shared vertices)", &md_indexed)) {
+				mesh->setIndexed(md_indexed);
+			}
+			const char* normal_modes[] = { "Face", "Density gradient" }; // In the order of TerrainMesh::NormalMode
+			if (ImGui::Combo("Normals", &md_normal_mode, normal_modes, IM_ARRAYSIZE(normal_modes))) {
+				mesh->setNormalMode(static_cast<TerrainMesh::NormalMode>(md_normal_mode));
+			}
+			if (ImGui::Checkbox("Count, then write into mapped buffers", &md_mapped_upload)) {
+				mesh->setMappedUpload(md_mapped_upload);
+			}
+			if (ImGui::SliderFloat("Level of detail distance (0 = off)", &md_lod_distance, 0.0f, 512.0f)) {
+				mesh->setLodDistance(md_lod_distance);
+			}
+			if (ImGui::SliderFloat("Simplification error (0 = off)", &md_simplification_error, 0.0f, 2.0f)) {
+				mesh->setSimplificationError(md_simplification_error);
+			}
+			if (ImGui::SliderFloat("Simplify after seconds without edits", &md_simplification_delay, 0.0f, 10.0f)) {
+				mesh->setSimplificationDelay(md_simplification_delay);
+			}
+			if (ImGui::Checkbox("Optimize indexed chunks for the vertex cache", &md_optimize_vertex_cache)) {
+				mesh->setOptimizeVertexCache(md_optimize_vertex_cache);
+			}
+			const char* vertex_formats[] = { "Full (24 bytes)", "Compact (8 bytes)" }; // In the order of TerrainMesh::VertexFormat
+			if (ImGui::Combo("Vertex format", &md_vertex_format, vertex_formats, IM_ARRAYSIZE(vertex_formats))) {
+				mesh->setVertexFormat(static_cast<TerrainMesh::VertexFormat>(md_vertex_format));
+			}
+			if (mesh->isComputeMeshingAvailable()) {
+				if (ImGui::Checkbox("Generate the mesh in compute shaders", &md_compute_meshing)) {
+					mesh->setComputeMeshing(md_compute_meshing);
+				}
+			}
+			else {
+				ImGui::TextDisabled("Compute shader meshing needs OpenGL 4.3");
+			}
+			ImGui::Text("Cube classification: %s", MeshingKernels::getName(MeshingKernels::getBestInstructions()));
+			if (ImGui::Button("Benchmark classification")) {
+				md_classification_benchmark = mesh->benchmarkClassification();
+			}
+			for (const auto& result : md_classification_benchmark) {
+				ImGui::Text("  %s: %.1f million cubes/s", MeshingKernels::getName(result.first), result.second / 1e6);
+			}
+			if (ImGui::Button("Benchmark meshers")) {
+				md_mesher_benchmark = mesh->benchmarkMeshers();
+			}
+			for (const auto& result : md_mesher_benchmark) {
+				ImGui::Text("  %s: %zu triangles, %zu vertices, %.1f MB, %.1f ms", algorithms[static_cast<int>(result.algorithm)],
+					result.triangles, result.vertices, result.bytes / (1024.0 * 1024.0), result.milliseconds);
+			}
+			if (ImGui::Button("Benchmark simplification")) {
+				md_simplification_benchmark = mesh->benchmarkSimplification();
+			}
+			for (const auto& result : md_simplification_benchmark) {
+				ImGui::Text("  Error %.2f: %zu -> %zu triangles (%.1f%%), reached error %.3f, %.1f ms", result.targetError, result.trianglesBefore, result.trianglesAfter,
+					100.0 * result.trianglesAfter / std::max<size_t>(result.trianglesBefore, 1), result.error, result.milliseconds);
+			}
+			if (ImGui::Button("Benchmark vertex cache")) {
+				md_vertex_cache_benchmark = mesh->benchmarkVertexCache();
+			}
+			for (const auto& result : md_vertex_cache_benchmark) {
+				ImGui::Text("  %s order: ACMR %.3f, ATVR %.3f, %.1f ms", result.optimized ? "Optimized" : "Generated", result.acmr, result.atvr, result.milliseconds);
+			}
+			ImGui::InputText("Export path", md_export_path, sizeof(md_export_path));
+			if (ImGui::Button("Export PLY")) {
+				mesh->exportMesh(std::string(md_export_path) + ".ply", MeshExporter::Format::ply);
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Export OBJ")) {
+				mesh->exportMesh(std::string(md_export_path) + ".obj", MeshExporter::Format::obj);
+			}
 		}
 		ImGui::Separator();
 
@@ -4,6 +4,7 @@
 #include "TerrainGrid.h"
 #include "TerrainMesh.h"
 #include "DebugPointsRenderer.h"
+#include "SculptHistory.h"
 
 
 // The config is an object representation of the state of the Scene Controls window
@@ -11,14 +12,16 @@
 class Config {
 public:
 	Config() = delete; // No default constructor, we require a TerrainGrid to be provided
-	Config(TerrainGrid* terrain, DebugPointsRenderer* debugPointRenderer, TerrainMesh* mesh);
+	Config(TerrainGrid* terrain, DebugPointsRenderer* debugPointRenderer, TerrainMesh* mesh, SculptHistory* history);
 	void draw_config();
 
 	glm::ivec3 terrain_dimensions; // The amount of voxels in the terrain grid
 	float terrain_scale; // The distance between each voxel in the terrain grid
+	int terrain_precision; // A TerrainGrid::Precision
 
 	float sculpter_size; // The size of the sculpting brush
 	float sculpter_strength; // The strength of the sculpting brush
+	float sculpter_history_limit; // The megabytes the undo history may use
 
 	bool pd_show_points_debugger; // pd_ = points_debugger_
 	float pd_point_size;
@@ -29,6 +32,22 @@ public:
 
 	bool md_show_terrain_mesh; // md_ = mesh_debugger_
 	float md_iso_level;
+	int md_algorithm; // A TerrainMesh::Algorithm
+	int md_worker_count; // The amount of threads used to generate the mesh
+	bool md_indexed; // Share the vertices between neighbouring cubes
+	int md_normal_mode; // A TerrainMesh::NormalMode
+	bool md_mapped_upload; // Write the mesh straight into mapped vertex buffers
+	int md_vertex_format; // A TerrainMesh::VertexFormat
+	float md_lod_distance; // The distance at which chunks start using a lower level of detail
+	float md_simplification_error; // The largest error the idle chunks are simplified to
+	float md_simplification_delay; // The seconds without edits before a chunk is simplified
+	bool md_optimize_vertex_cache; // Reorder the indexed chunks for the vertex cache
+	bool md_compute_meshing; // Generate the mesh in compute shaders instead of on the CPU
+	std::vector<std::pair<MeshingKernels::Instructions, double>> md_classification_benchmark; // Cubes per second of the last classification benchmark
+	std::vector<TerrainMesh::MesherBenchmark> md_mesher_benchmark; // The mesh size and generation time of each algorithm in the last mesher benchmark
+	std::vector<TerrainMesh::SimplificationBenchmark> md_simplification_benchmark; // The triangles left at each error in the last simplification benchmark
+	std::vector<TerrainMesh::VertexCacheBenchmark> md_vertex_cache_benchmark; // The cache statistics before and after the optimisation in the last vertex cache benchmark
+	char md_export_path[256]; // The file the mesh is exported to, without the extension of the format
 
 	bool show_sculpting_rays; // Toggle for showing sculpting debug rays
 	bool show_crosshair;
@@ -44,4 +63,5 @@ private:
 	TerrainGrid* terrain;
 	DebugPointsRenderer* debugPointRenderer;
 	TerrainMesh* mesh;
+	SculptHistory* history;
 };
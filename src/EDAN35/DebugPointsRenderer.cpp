@@ -2,20 +2,23 @@
 #include <glm/gtc/type_ptr.hpp>
 #include "core/Bonobo.h"
 
-DebugPointsRenderer::DebugPointsRenderer(TerrainGrid* grid) {
+DebugPointsRenderer::DebugPointsRenderer(TerrainGrid* grid) : vao(0), buffers(4 * 1024 * 1024), pointsDirty(true), minRange(0), maxRange(0) {
 	this->grid = grid;
 	this->vertexCount = 0;
 
 	// Register with the grid to get notified about grid changes
-	// This means updateVBO() will be called any time the grid changes
-	grid->registerUpdateCallback([this]() { this->updateVBO(); });
-	updateVBO();
+	// This means the points are regenerated on the next draw any time the voxels in their range change
+	grid->registerUpdateCallback([this](glm::ivec3 regionMin, glm::ivec3 regionMax) {
+		bool overlaps = regionMin.x < maxRange.x && regionMin.y < maxRange.y && regionMin.z < maxRange.z
+			&& minRange.x < regionMax.x && minRange.y < regionMax.y && minRange.z < regionMax.z;
+		if (overlaps) pointsDirty = true;
+	});
 };
 
 
 void DebugPointsRenderer::draw(FPSCameraf* camera, GLuint shader, float pointSize) {
-	// If there is no VBO yet, create one
-	if (vbo == 0) {
+	// The points are only regenerated when they are drawn, so a hidden points debugger costs nothing while sculpting
+	if (pointsDirty) {
 		updateVBO();
 	}
 
@@ -53,46 +56,54 @@ void DebugPointsRenderer::setDebugPointsRange(glm::ivec3 minIndexes, glm::ivec3
 
 		vertexCount = count;
 
-		// Regenerate the vbo
-		updateVBO();
+		// Regenerate the vbo when the points are drawn next
+		pointsDirty = true;
 }
 
 void DebugPointsRenderer::updateVBO() {
-	// If we still have old debug points, delete them
-	if (vbo != 0) {
-		glDeleteBuffers(1, &vbo);
-		glDeleteVertexArrays(1, &vao);
+	// The VAO is created once, and pointed at the new points every time they change
+	if (vao == 0) {
+		glGenVertexArrays(1, &vao);
 	}
+	pointsDirty = false;
 
-	// Generate the new VAO and VBO
-	glGenBuffers(1, &vbo);
-	glGenVertexArrays(1, &vao);
-
-	// Bind the VAO and VBO
-	glBindVertexArray(vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-
-	// Load all the points into a float array
+	// Load all the points into a float array, a row of voxels at a time so that they are only bounds checked once per row
 	std::vector<float> points;
-	for (int x = minRange.x; x < maxRange.x; x++)
-		for (int y = minRange.y; y < maxRange.y; y++)
-			for (int z = minRange.z; z < maxRange.z; z++) {
-				points.push_back((float)x * grid->getScale());
-				points.push_back((float)y * grid->getScale());
-				points.push_back((float)z * grid->getScale());
-				points.push_back(grid->get(glm::ivec3(x, y, z))); // push the colour to the voxel
+	points.reserve(vertexCount * 4);
+	std::vector<float> row(glm::max(maxRange.x - minRange.x, 0));
+	float scale = grid->getScale();
+	for (int z = minRange.z; z < maxRange.z; z++)
+		for (int y = minRange.y; y < maxRange.y; y++) {
+			grid->getRow(glm::ivec3(minRange.x, y, z), static_cast<int>(row.size()), row.data());
+			for (int x = minRange.x; x < maxRange.x; x++) {
+				points.push_back((float)x * scale);
+				points.push_back((float)y * scale);
+				points.push_back((float)z * scale);
+				points.push_back(row[x - minRange.x]); // push the colour to the voxel
 			}
+		}
 
-	// Move the data to the VBO
-	glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(float), points.data(), GL_STATIC_DRAW);
+	// Move the data to a new range of the buffer arena, the old range is reused once the GPU is done drawing it
+	buffers.Free(pointsRange);
+	pointsRange = buffers.Allocate(points.size() * sizeof(float));
+	buffers.Upload(pointsRange, points.data(), points.size() * sizeof(float));
+	buffers.Retire();
+	if (pointsRange.page < 0) {
+		return; // No points to draw
+	}
+
+	// Bind the VAO and the buffer holding the points
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers.GetBuffer(pointsRange));
 
 	// Load the attribute information into the VAO
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0); // the world position data (at pos=0) needs 3 floats of data
-	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(3 * sizeof(float))); // the colour flag data (at pos=1) needs 1 float of data
+	const char* start = reinterpret_cast<const char*>(pointsRange.offset);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), start); // the world position data (at pos=0) needs 3 floats of data
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float), start + 3 * sizeof(float)); // the colour flag data (at pos=1) needs 1 float of data
 	glEnableVertexAttribArray(0); // Enable position at pos=0
 	glEnableVertexAttribArray(1); // Enable colour flag at pos=1
 
 	// Unbind the VAO and VBO so that they are not accidentically used later
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "TerrainGrid.h"
+#include "core/BufferArena.hpp"
 
 #include <glm/glm.hpp>
 #include <vector>
@@ -14,7 +15,10 @@ public:
 
 
 private:
-	GLuint vbo, vao;
+	GLuint vao;
+	BufferArena buffers; // Holds the points, so that changing them reuses the same buffer
+	BufferArena::Allocation pointsRange; // The range of the buffer arena with the current points
+	bool pointsDirty; // Whether the points changed since they were last uploaded
 	void updateVBO();
 
 	TerrainGrid* grid;
@@ -0,0 +1,169 @@
+#include "MeshExporter.h"
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace {
+	const size_t STREAM_BUFFER_SIZE = 1 << 20;
+
+	bool isLittleEndian() {
+		const uint16_t one = 1;
+		unsigned char first;
+		std::memcpy(&first, &one, 1);
+		return first == 1;
+	}
+
+	// Appends the bytes of value in little endian order
+	template <typename T>
+	void appendLittleEndian(std::vector<char>& out, T value) {
+		char bytes[sizeof(T)];
+		std::memcpy(bytes, &value, sizeof(T));
+		if (!isLittleEndian()) {
+			for (size_t i = 0; i < sizeof(T) / 2; i++) std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+		}
+		out.insert(out.end(), bytes, bytes + sizeof(T));
+	}
+}
+
+MeshExporter::MeshExporter()
+	: format(Format::ply), file(nullptr), faces(nullptr), vertexCountOffset(0), faceCountOffset(0), vertexCount(0), triangleCount(0) {
+}
+
+MeshExporter::~MeshExporter() {
+	close();
+}
+
+bool MeshExporter::open(const std::string& path, Format format) {
+	close();
+	this->format = format;
+	vertexCount = 0;
+	triangleCount = 0;
+
+	file = std::fopen(path.c_str(), format == Format::ply ? "wb" : "w");
+	if (!file) return false;
+	fileBuffer.resize(STREAM_BUFFER_SIZE);
+	std::setvbuf(file, fileBuffer.data(), _IOFBF, fileBuffer.size());
+
+	if (format == Format::obj) {
+		return std::fprintf(file, "# Terrain surface\n") > 0;
+	}
+
+	faces = std::tmpfile();
+	if (!faces) {
+		close();
+		return false;
+	}
+	facesBuffer.resize(STREAM_BUFFER_SIZE);
+	std::setvbuf(faces, facesBuffer.data(), _IOFBF, facesBuffer.size());
+
+	// The counts are padded with spaces, which PLY readers skip like any other whitespace
+	std::fprintf(file, "ply\nformat binary_little_endian 1.0\ncomment Terrain surface\nelement vertex ");
+	vertexCountOffset = std::ftell(file);
+	std::fprintf(file, "%*s\n", COUNT_DIGITS, "");
+	std::fprintf(file, "property float x\nproperty float y\nproperty float z\nproperty float nx\nproperty float ny\nproperty float nz\nelement face ");
+	faceCountOffset = std::ftell(file);
+	std::fprintf(file, "%*s\n", COUNT_DIGITS, "");
+	return std::fprintf(file, "property list uchar uint vertex_indices\nend_header\n") > 0;
+}
+
+bool MeshExporter::addBlock(const std::vector<float>& vertices, const std::vector<unsigned int>& indices) {
+	if (!file) return false;
+	size_t blockVertices = vertices.size() / 6;
+	size_t first = vertexCount;
+	// PLY stores the indices as 32 bit integers
+	if (format == Format::ply && first + blockVertices > std::numeric_limits<uint32_t>::max()) return false;
+
+	block.clear();
+	if (format == Format::ply) {
+		for (size_t i = 0; i < blockVertices * 6; i++) appendLittleEndian(block, vertices[i]);
+	}
+	else {
+		char line[128];
+		for (size_t v = 0; v < blockVertices; v++) {
+			const float* p = &vertices[v * 6];
+			// 9 significant digits are enough to read back the exact float, like the PLY export
+			int length = std::snprintf(line, sizeof(line), "v %.9g %.9g %.9g\nvn %.9g %.9g %.9g\n", p[0], p[1], p[2], p[3], p[4], p[5]);
+			block.insert(block.end(), line, line + length);
+		}
+	}
+	if (std::fwrite(block.data(), 1, block.size(), file) != block.size()) return false;
+	vertexCount += blockVertices;
+
+	if (indices.empty()) {
+		for (size_t v = 0; v + 2 < blockVertices; v += 3) {
+			if (!writeTriangle(unsigned(first + v), unsigned(first + v + 1), unsigned(first + v + 2))) return false;
+		}
+	}
+	else {
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			if (!writeTriangle(unsigned(first + indices[i]), unsigned(first + indices[i + 1]), unsigned(first + indices[i + 2]))) return false;
+		}
+	}
+	return true;
+}
+
+bool MeshExporter::writeTriangle(unsigned int a, unsigned int b, unsigned int c) {
+	triangleCount++;
+	if (format == Format::obj) {
+		// OBJ counts from 1, and every vertex has the normal of the same index
+		return std::fprintf(file, "f %u//%u %u//%u %u//%u\n", a + 1, a + 1, b + 1, b + 1, c + 1, c + 1) > 0;
+	}
+
+	unsigned char face[13] = { 3 };
+	uint32_t corners[3] = { a, b, c };
+	for (int i = 0; i < 3; i++) {
+		for (int byte = 0; byte < 4; byte++) face[1 + i * 4 + byte] = static_cast<unsigned char>(corners[i] >> (8 * byte));
+	}
+	return std::fwrite(face, 1, sizeof(face), faces) == sizeof(face);
+}
+
+bool MeshExporter::finish() {
+	if (!file) return false;
+	bool ok = true;
+
+	if (format == Format::ply) {
+		// Append the faces behind the vertices, then fill in the counts
+		std::vector<char>& copy = block;
+		copy.resize(STREAM_BUFFER_SIZE);
+		std::rewind(faces);
+		size_t read;
+		while (ok && (read = std::fread(copy.data(), 1, copy.size(), faces)) > 0) {
+			ok = std::fwrite(copy.data(), 1, read, file) == read;
+		}
+		ok = ok && !std::ferror(faces);
+
+		char count[COUNT_DIGITS + 1];
+		ok = ok && std::fseek(file, vertexCountOffset, SEEK_SET) == 0;
+		std::snprintf(count, sizeof(count), "%-*" PRIu64, COUNT_DIGITS, static_cast<uint64_t>(vertexCount));
+		ok = ok && std::fwrite(count, 1, COUNT_DIGITS, file) == COUNT_DIGITS;
+		ok = ok && std::fseek(file, faceCountOffset, SEEK_SET) == 0;
+		std::snprintf(count, sizeof(count), "%-*" PRIu64, COUNT_DIGITS, static_cast<uint64_t>(triangleCount));
+		ok = ok && std::fwrite(count, 1, COUNT_DIGITS, file) == COUNT_DIGITS;
+	}
+
+	ok = std::fflush(file) == 0 && ok;
+	close();
+	return ok;
+}
+
+size_t MeshExporter::getVertexCount() const {
+	return vertexCount;
+}
+
+size_t MeshExporter::getTriangleCount() const {
+	return triangleCount;
+}
+
+void MeshExporter::close() {
+	if (file) std::fclose(file);
+	if (faces) std::fclose(faces);
+	file = nullptr;
+	faces = nullptr;
+	// The stdio buffers are only released once their files are closed
+	fileBuffer = std::vector<char>();
+	facesBuffer = std::vector<char>();
+	block = std::vector<char>();
+}
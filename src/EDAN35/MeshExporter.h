@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/// Writes a triangle mesh to a binary PLY or an OBJ file, one block of vertices and triangles at a time,
+/// so that meshes far larger than the memory can be exported with only the current block in memory.
+///
+/// The vertices of a block go straight to the file. PLY needs every vertex before the first face,
+/// so its faces are streamed to a temporary file instead and appended to the real one in finish().
+///
+class MeshExporter {
+public:
+	enum class Format : unsigned int {
+		ply, // Binary little endian PLY, with the position and normal of every vertex
+		obj // Wavefront OBJ text, with a vertex normal for every vertex
+	};
+
+	MeshExporter();
+	~MeshExporter(); // Closes the files, leaving an unfinished export behind
+
+	MeshExporter(const MeshExporter&) = delete;
+	MeshExporter& operator=(const MeshExporter&) = delete;
+
+	bool open(const std::string& path, Format format);
+	// Appends a block of vertices (six floats each, position and normal) and its triangles, as three indices into the vertices of this block.
+	// Without indices, every three vertices of the block are a triangle.
+	bool addBlock(const std::vector<float>& vertices, const std::vector<unsigned int>& indices);
+	bool finish(); // Writes the faces and the final counts, and closes the file
+
+	size_t getVertexCount() const;
+	size_t getTriangleCount() const;
+
+private:
+	bool writeTriangle(unsigned int a, unsigned int b, unsigned int c); // With indices into the whole mesh
+	void close();
+
+	static const int COUNT_DIGITS = 10; // The PLY header is written before the counts are known, so they are padded to a fixed width and patched in finish()
+
+	Format format;
+	std::FILE* file;
+	std::FILE* faces; // The faces of a PLY file, until every vertex is written
+	long vertexCountOffset; // Where the counts are in the PLY header
+	long faceCountOffset;
+	size_t vertexCount;
+	size_t triangleCount;
+	std::vector<char> fileBuffer; // Large stdio buffers, so that the small writes of every vertex don't each reach the operating system
+	std::vector<char> facesBuffer;
+	std::vector<char> block; // Scratch memory the vertices of a block are encoded into
+};
@@ -0,0 +1,162 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	// The scoring constants from Forsyth's article
+	const float CACHE_DECAY_POWER = 1.5f;
+	const float LAST_TRIANGLE_SCORE = 0.75f;
+	const float VALENCE_BOOST_SCALE = 2.0f;
+	const float VALENCE_BOOST_POWER = 0.5f;
+}
+
+double MeshOptimizer::CacheStatistics::getAcmr() const {
+	return triangles > 0 ? double(misses) / triangles : 0.0;
+}
+
+double MeshOptimizer::CacheStatistics::getAtvr() const {
+	return vertices > 0 ? double(misses) / vertices : 0.0;
+}
+
+float MeshOptimizer::vertexScore(int cachePosition, unsigned int remainingTriangles) const {
+	if (remainingTriangles == 0) return -1.0f; // Nothing left to draw with it
+
+	// Used by the last triangle when it is at the front of the cache. A fixed score, so that the next triangle doesn't just reuse the same edge in strips.
+	float score = cachePosition < 0 ? 0.0f : cacheScores[cachePosition];
+	// Prefer the vertices with few triangles left, so that they are finished before they fall out of the cache
+	return score + (remainingTriangles < VALENCE_SCORES ? valenceScores[remainingTriangles] : VALENCE_BOOST_SCALE * std::pow(float(remainingTriangles), -VALENCE_BOOST_POWER));
+}
+
+void MeshOptimizer::optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount) {
+	size_t triangleCount = indices.size() / 3;
+	if (triangleCount == 0) return;
+
+	// The scores only depend on small integers, so compute them once instead of for every vertex every time it moves
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		cacheScores[i] = i < 3 ? LAST_TRIANGLE_SCORE : std::pow(1.0f - float(i - 3) / (CACHE_SIZE - 3), CACHE_DECAY_POWER);
+	}
+	valenceScores[0] = 0.0f;
+	for (unsigned int i = 1; i < VALENCE_SCORES; i++) {
+		valenceScores[i] = VALENCE_BOOST_SCALE * std::pow(float(i), -VALENCE_BOOST_POWER);
+	}
+
+	// The triangles around every vertex
+	remaining.assign(vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++) {
+		remaining[indices[i]]++;
+	}
+	triangleOffsets.resize(vertexCount + 1);
+	triangleOffsets[0] = 0;
+	for (size_t v = 0; v < vertexCount; v++) {
+		triangleOffsets[v + 1] = triangleOffsets[v] + remaining[v];
+	}
+	vertexTriangles.resize(triangleCount * 3);
+	std::fill(remaining.begin(), remaining.end(), 0);
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = indices[t * 3 + k];
+			vertexTriangles[triangleOffsets[v] + remaining[v]++] = static_cast<unsigned int>(t);
+		}
+	}
+
+	cachePositions.assign(vertexCount, -1);
+	vertexScores.resize(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++) {
+		vertexScores[v] = vertexScore(-1, remaining[v]);
+	}
+	auto triangleScore = [this, &indices](size_t t) { return vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]]; };
+	triangleDrawn.assign(triangleCount, 0);
+	cache.clear();
+	output.clear();
+	output.reserve(triangleCount * 3);
+
+	size_t nextUndrawn = 0; // Where to look for a triangle to continue with when none around the cache is left
+	size_t best = 0;
+	float bestScore = triangleScore(0);
+	for (size_t t = 1; t < triangleCount; t++) {
+		float score = triangleScore(t);
+		if (score > bestScore) {
+			bestScore = score;
+			best = t;
+		}
+	}
+
+	for (size_t drawn = 0; drawn < triangleCount; drawn++) {
+		if (best == triangleCount) {
+			// Nothing in the cache has triangles left, start again from the first undrawn triangle
+			while (triangleDrawn[nextUndrawn]) nextUndrawn++;
+			best = nextUndrawn;
+		}
+
+		triangleDrawn[best] = 1;
+		const unsigned int* corners = &indices[best * 3];
+		output.insert(output.end(), corners, corners + 3);
+
+		// The triangle is no longer waiting around its vertices
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = corners[k];
+			unsigned int* first = &vertexTriangles[triangleOffsets[v]];
+			unsigned int* last = first + remaining[v];
+			*std::find(first, last, static_cast<unsigned int>(best)) = *(last - 1);
+			remaining[v]--;
+		}
+
+		// Move the triangle's vertices to the front of the cache, the others back, and forget the ones that fall out
+		nextCache.assign(corners, corners + 3);
+		for (unsigned int v : cache) {
+			if (v != corners[0] && v != corners[1] && v != corners[2]) nextCache.push_back(v);
+		}
+		for (size_t i = 0; i < nextCache.size(); i++) {
+			unsigned int v = nextCache[i];
+			cachePositions[v] = i < CACHE_SIZE ? static_cast<int>(i) : -1;
+			vertexScores[v] = vertexScore(cachePositions[v], remaining[v]);
+		}
+		if (nextCache.size() > CACHE_SIZE) nextCache.resize(CACHE_SIZE);
+		cache.swap(nextCache);
+
+		// Only the triangles around the vertices that moved changed their score, continue with the best of them
+		best = triangleCount;
+		bestScore = -1.0f;
+		for (unsigned int v : cache) {
+			for (unsigned int i = 0; i < remaining[v]; i++) {
+				unsigned int t = vertexTriangles[triangleOffsets[v] + i];
+				float score = triangleScore(t);
+				if (score > bestScore) {
+					bestScore = score;
+					best = t;
+				}
+			}
+		}
+	}
+	indices.swap(output);
+}
+
+void MeshOptimizer::optimizeVertexFetch(std::vector<float>& vertices, std::vector<unsigned int>& indices) {
+	size_t vertexCount = vertices.size() / 6;
+	remap.assign(vertexCount, ~0u);
+	reordered.clear();
+	reordered.reserve(vertices.size());
+	for (unsigned int& index : indices) {
+		if (remap[index] == ~0u) {
+			remap[index] = static_cast<unsigned int>(reordered.size() / 6);
+			reordered.insert(reordered.end(), &vertices[index * 6], &vertices[index * 6] + 6);
+		}
+		index = remap[index];
+	}
+	vertices.swap(reordered);
+}
+
+MeshOptimizer::CacheStatistics MeshOptimizer::analyzeVertexCache(const std::vector<unsigned int>& indices, size_t vertexCount, int cacheSize) {
+	CacheStatistics statistics = { 0, indices.size() / 3, vertexCount };
+
+	// A FIFO cache: a vertex is a miss unless it was one of the last cacheSize misses
+	std::vector<size_t> missTime(vertexCount, 0); // One past the miss that put every vertex in the cache, 0 for never
+	for (unsigned int index : indices) {
+		if (missTime[index] == 0 || statistics.misses + 1 - missTime[index] > static_cast<size_t>(cacheSize)) {
+			statistics.misses++;
+			missTime[index] = statistics.misses;
+		}
+	}
+	return statistics;
+}
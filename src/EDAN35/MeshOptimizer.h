@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/// Reorders indexed triangle meshes for the GPU: the triangles for the post-transform vertex cache (Forsyth's linear-speed vertex cache optimisation),
+/// and then the vertices in the order the triangles first use them, so the vertex fetches walk through memory instead of jumping around it.
+/// Neither changes the surface, only the order it is drawn in.
+///
+/// The optimizer keeps its working memory between calls, use one per thread.
+///
+class MeshOptimizer {
+public:
+	// How well a triangle order uses a vertex cache, from simulating a FIFO cache of some size
+	struct CacheStatistics {
+		size_t misses; // Vertices that had to be transformed
+		size_t triangles;
+		size_t vertices;
+
+		double getAcmr() const; // Average cache miss ratio: transformed vertices per triangle, between 0.5 (ideal for large meshes) and 3
+		double getAtvr() const; // Average transformed vertex ratio: how many times every vertex is transformed, 1 is ideal
+	};
+
+	// Reorders the triangles (three vertices each) so that they reuse the vertices of the triangles just before them
+	void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount);
+	// Reorders the vertices (six floats each, position and normal) in the order the triangles first use them, and drops the unused ones
+	void optimizeVertexFetch(std::vector<float>& vertices, std::vector<unsigned int>& indices);
+
+	static CacheStatistics analyzeVertexCache(const std::vector<unsigned int>& indices, size_t vertexCount, int cacheSize);
+
+	static const int CACHE_SIZE = 32; // The LRU cache the triangle order is optimised for
+	static const int SIMULATED_CACHE_SIZE = 16; // The FIFO cache of the statistics, a common size for the post-transform caches of GPUs
+
+private:
+	float vertexScore(int cachePosition, unsigned int remainingTriangles) const;
+
+	static const unsigned int VALENCE_SCORES = 32; // Vertices with more triangles left than this compute their score
+	float cacheScores[CACHE_SIZE]; // The score of every position in the cache
+	float valenceScores[VALENCE_SCORES]; // The score of every amount of triangles left
+
+	std::vector<unsigned int> triangleOffsets; // Where the triangles of every vertex start in vertexTriangles
+	std::vector<unsigned int> vertexTriangles; // The triangles around every vertex that aren't drawn yet, at the front of each vertex's range
+	std::vector<unsigned int> remaining; // The amount of triangles around every vertex that aren't drawn yet
+	std::vector<int> cachePositions; // The position of every vertex in the simulated cache, -1 when it isn't in it
+	std::vector<float> vertexScores;
+	std::vector<char> triangleDrawn;
+	std::vector<unsigned int> cache;
+	std::vector<unsigned int> nextCache;
+	std::vector<unsigned int> output;
+	std::vector<unsigned int> remap; // The new index of every vertex
+	std::vector<float> reordered;
+};
@@ -0,0 +1,247 @@
+#include "MeshSimplifier.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+
+void MeshSimplifier::Quadric::addPlane(glm::dvec3 normal, double d) {
+	a2 += normal.x * normal.x; ab += normal.x * normal.y; ac += normal.x * normal.z; ad += normal.x * d;
+	b2 += normal.y * normal.y; bc += normal.y * normal.z; bd += normal.y * d;
+	c2 += normal.z * normal.z; cd += normal.z * d;
+	d2 += d * d;
+}
+
+void MeshSimplifier::Quadric::add(const Quadric& other) {
+	a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+	b2 += other.b2; bc += other.bc; bd += other.bd;
+	c2 += other.c2; cd += other.cd;
+	d2 += other.d2;
+}
+
+double MeshSimplifier::Quadric::evaluate(glm::dvec3 p) const {
+	// p^T A p + 2 b^T p + c, with A the upper 3x3 part of the matrix
+	double error = a2 * p.x * p.x + 2.0 * ab * p.x * p.y + 2.0 * ac * p.x * p.z + b2 * p.y * p.y + 2.0 * bc * p.y * p.z + c2 * p.z * p.z
+		+ 2.0 * (ad * p.x + bd * p.y + cd * p.z) + d2;
+	return std::max(error, 0.0); // Rounding can make it slightly negative
+}
+
+float MeshSimplifier::pointTriangleDistance(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+	// Finds the closest point by the region of the triangle p projects into (Ericson, Real-Time Collision Detection 5.1.5)
+	glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) return glm::length(p - a);
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3) return glm::length(p - b);
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return glm::length(p - (a + ab * (d1 / (d1 - d3))));
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6) return glm::length(p - c);
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return glm::length(p - (a + ac * (d2 / (d2 - d6))));
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) return glm::length(p - (b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)))));
+	float denominator = va + vb + vc;
+	if (denominator <= 0.0f) return glm::length(p - a); // Degenerate
+	return glm::length(p - (a + ab * (vb / denominator) + ac * (vc / denominator)));
+}
+
+float MeshSimplifier::simplify(std::vector<float>& vertices, std::vector<unsigned int>& indices, float maxError) {
+	this->vertices = &vertices;
+	this->indices = &indices;
+	this->maxError = maxError;
+	unsigned int vertexCount = static_cast<unsigned int>(vertices.size() / 6);
+	unsigned int triangleCount = static_cast<unsigned int>(indices.size() / 3);
+	if (triangleCount == 0 || maxError <= 0.0f) return 0.0f;
+
+	// Every vertex starts with the planes of the triangles around it, so its error is the squared distance to them
+	quadrics.assign(vertexCount, Quadric{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 });
+	if (vertexTriangles.size() < vertexCount) vertexTriangles.resize(vertexCount);
+	for (unsigned int v = 0; v < vertexCount; v++) vertexTriangles[v].clear();
+	triangleRemoved.assign(triangleCount, 0);
+	for (unsigned int t = 0; t < triangleCount; t++) {
+		const unsigned int* corners = &indices[t * 3];
+		glm::dvec3 p0(position(corners[0])), p1(position(corners[1])), p2(position(corners[2]));
+		glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+		double length = glm::length(normal);
+		if (length > 0.0) {
+			normal /= length;
+			for (int i = 0; i < 3; i++) quadrics[corners[i]].addPlane(normal, -glm::dot(normal, p0));
+		}
+		for (int i = 0; i < 3; i++) vertexTriangles[corners[i]].push_back(t);
+	}
+
+	// Lock the vertices of every edge that isn't shared by exactly two triangles, which are the border of the chunk and any non-manifold edges
+	vertexLocked.assign(vertexCount, 0);
+	edgeKeys.clear();
+	for (unsigned int t = 0; t < triangleCount; t++) {
+		for (int i = 0; i < 3; i++) {
+			unsigned long long a = indices[t * 3 + i], b = indices[t * 3 + (i + 1) % 3];
+			edgeKeys.push_back(std::min(a, b) << 32 | std::max(a, b));
+		}
+	}
+	std::sort(edgeKeys.begin(), edgeKeys.end());
+	for (size_t first = 0; first < edgeKeys.size();) {
+		size_t last = first;
+		while (last < edgeKeys.size() && edgeKeys[last] == edgeKeys[first]) last++;
+		if (last - first != 2) {
+			vertexLocked[edgeKeys[first] >> 32] = 1;
+			vertexLocked[edgeKeys[first] & 0xFFFFFFFFull] = 1;
+		}
+		first = last;
+	}
+
+	vertexRemoved.assign(vertexCount, 0);
+	versions.assign(vertexCount, 0);
+	queue.clear();
+	for (unsigned int v = 0; v < vertexCount; v++) {
+		if (!vertexLocked[v]) queueCollapses(v);
+	}
+
+	// Collapse the cheapest edge until the cheapest one is above the maximum error.
+	// Collapses whose vertices changed since they were queued were queued again with their new cost, so the old entry is skipped.
+	double maxCost = static_cast<double>(maxError) * maxError;
+	double largestCost = 0.0;
+	while (!queue.empty()) {
+		std::pop_heap(queue.begin(), queue.end(), std::greater<Collapse>());
+		Collapse next = queue.back();
+		queue.pop_back();
+		if (next.cost > maxCost) break;
+		if (vertexRemoved[next.from] || vertexRemoved[next.to]) continue;
+		if (versions[next.from] != next.fromVersion || versions[next.to] != next.toVersion) continue;
+		if (!canCollapse(next.from, next.to)) continue;
+
+		collapse(next.from, next.to);
+		largestCost = std::max(largestCost, next.cost);
+	}
+
+	// Compact the remaining vertices, in their original order so that the copies never overwrite a vertex still to be copied
+	remap.assign(vertexCount, ~0u);
+	for (unsigned int t = 0; t < triangleCount; t++) {
+		if (triangleRemoved[t]) continue;
+		for (int i = 0; i < 3; i++) remap[indices[t * 3 + i]] = 0;
+	}
+	unsigned int keptVertices = 0;
+	for (unsigned int v = 0; v < vertexCount; v++) {
+		if (remap[v] == ~0u) continue;
+		remap[v] = keptVertices;
+		std::copy(&vertices[v * 6], &vertices[v * 6] + 6, &vertices[keptVertices * 6]);
+		keptVertices++;
+	}
+	vertices.resize(keptVertices * 6);
+
+	// And the remaining triangles
+	unsigned int keptIndices = 0;
+	for (unsigned int t = 0; t < triangleCount; t++) {
+		if (triangleRemoved[t]) continue;
+		for (int i = 0; i < 3; i++) indices[keptIndices++] = remap[indices[t * 3 + i]];
+	}
+	indices.resize(keptIndices);
+	return static_cast<float>(std::sqrt(largestCost));
+}
+
+void MeshSimplifier::queueCollapses(unsigned int vertex) {
+	for (unsigned int t : vertexTriangles[vertex]) {
+		if (triangleRemoved[t]) continue;
+		for (int i = 0; i < 3; i++) {
+			unsigned int other = (*indices)[t * 3 + i];
+			if (other == vertex) continue;
+			if (!vertexLocked[vertex]) queueCollapse(vertex, other);
+			if (!vertexLocked[other]) queueCollapse(other, vertex);
+		}
+	}
+}
+
+void MeshSimplifier::queueCollapse(unsigned int from, unsigned int to) {
+	// The collapsed vertex is left with the planes of both, and sits where to is
+	Quadric combined = quadrics[from];
+	combined.add(quadrics[to]);
+	queue.push_back({ combined.evaluate(glm::dvec3(position(to))), from, to, versions[from], versions[to] });
+	std::push_heap(queue.begin(), queue.end(), std::greater<Collapse>());
+}
+
+bool MeshSimplifier::canCollapse(unsigned int from, unsigned int to) {
+	// Link condition: the only vertices next to both are the third corners of the two triangles on the edge,
+	// otherwise the collapse would fold two parts of the surface onto each other
+	neighbours.clear();
+	int sharedTriangles = 0;
+	for (unsigned int t : vertexTriangles[from]) {
+		if (triangleRemoved[t]) continue;
+		const unsigned int* corners = &(*indices)[t * 3];
+		bool hasTo = corners[0] == to || corners[1] == to || corners[2] == to;
+		sharedTriangles += hasTo;
+		for (int i = 0; i < 3; i++) {
+			if (corners[i] != from && corners[i] != to) neighbours.push_back(corners[i]);
+		}
+	}
+	if (sharedTriangles != 2) return false;
+	std::sort(neighbours.begin(), neighbours.end());
+	neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+	int common = 0;
+	for (unsigned int t : vertexTriangles[to]) {
+		if (triangleRemoved[t]) continue;
+		for (int i = 0; i < 3; i++) {
+			unsigned int corner = (*indices)[t * 3 + i];
+			if (corner == from || corner == to) continue;
+			auto found = std::lower_bound(neighbours.begin(), neighbours.end(), corner);
+			if (found != neighbours.end() && *found == corner) {
+				common++;
+				neighbours.erase(found); // Count every common neighbour once
+			}
+		}
+	}
+	if (common != 2) return false;
+
+	// The triangles that move along with from must keep facing the same way, and not become slivers.
+	// The quadric only measures the distance to the planes of the triangles, so also check that from stays close to the triangles that replace it.
+	glm::vec3 target = position(to);
+	glm::vec3 removed = position(from);
+	float closest = FLT_MAX;
+	for (unsigned int t : vertexTriangles[from]) {
+		if (triangleRemoved[t]) continue;
+		const unsigned int* corners = &(*indices)[t * 3];
+		if (corners[0] == to || corners[1] == to || corners[2] == to) continue; // Removed by the collapse
+		glm::vec3 before[3], after[3];
+		for (int i = 0; i < 3; i++) {
+			before[i] = position(corners[i]);
+			after[i] = corners[i] == from ? target : before[i];
+		}
+		glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+		glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+		float lengthBefore = glm::length(normalBefore);
+		float lengthAfter = glm::length(normalAfter);
+		if (lengthAfter <= 1e-6f * lengthBefore || lengthAfter == 0.0f) return false;
+		if (glm::dot(normalBefore, normalAfter) < 0.5f * lengthBefore * lengthAfter) return false; // Turned by more than 60 degrees
+		closest = std::min(closest, pointTriangleDistance(removed, after[0], after[1], after[2]));
+	}
+	return closest <= maxError;
+}
+
+void MeshSimplifier::collapse(unsigned int from, unsigned int to) {
+	quadrics[to].add(quadrics[from]);
+	vertexRemoved[from] = 1;
+	for (unsigned int t : vertexTriangles[from]) {
+		if (triangleRemoved[t]) continue;
+		unsigned int* corners = &(*indices)[t * 3];
+		if (corners[0] == to || corners[1] == to || corners[2] == to) {
+			triangleRemoved[t] = 1;
+			continue;
+		}
+		for (int i = 0; i < 3; i++) {
+			if (corners[i] == from) corners[i] = to;
+		}
+		vertexTriangles[to].push_back(t);
+	}
+	vertexTriangles[from].clear();
+
+	// The edges around to have a new cost, and so do the vertices next to it, whose quadric is combined with the new one of to
+	versions[to]++;
+	queueCollapses(to);
+}
+
+glm::vec3 MeshSimplifier::position(unsigned int vertex) const {
+	const float* v = &(*vertices)[vertex * 6];
+	return glm::vec3(v[0], v[1], v[2]);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+/// Simplifies indexed triangle meshes by collapsing their edges in order of the quadric error metric (Garland and Heckbert).
+/// Every edge is collapsed into one of its vertices, so the remaining vertices keep their position and normal.
+/// Vertices on the border of the mesh never move, so that the simplified meshes of neighbouring chunks still meet the full ones.
+///
+/// The simplifier keeps its working memory between calls, use one per thread.
+///
+class MeshSimplifier {
+public:
+	// Collapses edges of the mesh until every remaining collapse would move the surface further than maxError from the planes of the triangles it replaces.
+	// vertices holds 6 floats (position and normal) per vertex and indices three vertices per triangle, both are replaced by the simplified mesh.
+	// Returns the largest error of the collapses that were made.
+	float simplify(std::vector<float>& vertices, std::vector<unsigned int>& indices, float maxError);
+
+	static float pointTriangleDistance(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c); // The distance from p to the closest point of the triangle abc
+
+private:
+	// The sum of the squared distances to some planes, as a symmetric 4x4 matrix
+	struct Quadric {
+		double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+		void addPlane(glm::dvec3 normal, double d);
+		void add(const Quadric& other);
+		double evaluate(glm::dvec3 p) const;
+	};
+
+	// Collapsing from into to, queued with the versions of both vertices at the time its cost was computed
+	struct Collapse {
+		double cost;
+		unsigned int from, to;
+		unsigned int fromVersion, toVersion;
+
+		bool operator>(const Collapse& other) const { return cost > other.cost; }
+	};
+
+	void queueCollapses(unsigned int vertex); // Queues the collapses along every edge of the vertex
+	void queueCollapse(unsigned int from, unsigned int to);
+	bool canCollapse(unsigned int from, unsigned int to); // Whether the collapse keeps the mesh manifold and doesn't flip any triangle
+	void collapse(unsigned int from, unsigned int to);
+	glm::vec3 position(unsigned int vertex) const;
+
+	float maxError;
+	std::vector<float>* vertices;
+	std::vector<unsigned int>* indices;
+	std::vector<Quadric> quadrics;
+	std::vector<std::vector<unsigned int>> vertexTriangles; // The triangles around every vertex, which can include removed ones
+	std::vector<char> triangleRemoved;
+	std::vector<unsigned long long> edgeKeys; // Both vertices of every triangle edge, to find the border
+	std::vector<char> vertexLocked; // On the border of the mesh
+	std::vector<char> vertexRemoved;
+	std::vector<unsigned int> versions; // Bumped whenever the edges of a vertex change, to skip outdated collapses in the queue
+	std::vector<Collapse> queue; // A min heap on the cost
+	std::vector<unsigned int> neighbours; // Scratch memory for the vertices around an edge
+	std::vector<unsigned int> remap; // Scratch memory for compacting the vertices
+};
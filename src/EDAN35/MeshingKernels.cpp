@@ -0,0 +1,216 @@
+#include "MeshingKernels.h"
+
+#include <cstring>
+
+// SSE2 is part of every x86-64 CPU, so it can be used without checking the CPU at runtime
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MESHING_KERNELS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// SSE4.1 and AVX2 are compiled for every x86 build, but only used after checking the CPU at runtime
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MESHING_KERNELS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define MESHING_KERNELS_TARGET(instructions)
+#else
+#define MESHING_KERNELS_TARGET(instructions) __attribute__((target(instructions)))
+#endif
+#endif
+
+namespace {
+	typedef bool (*ClassifyFunction)(const float*, const float*, const float*, const float*, int, float, unsigned char*);
+
+	// Classifies the cubes [start, count) one at a time, also used for the cubes left over by the vectorised kernels.
+	// inside and outside are combined with every cube index (& and |), so that the kernels can tell if the whole row is uniform.
+	void classifyScalar(const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int start, int count, float isoLevel,
+		unsigned char* cubeIndices, unsigned int& inside, unsigned int& outside)
+	{
+		for (int i = start; i < count; i++) {
+			unsigned int cubeIndex = 0;
+			if (row[i] < isoLevel) cubeIndex |= 1;
+			if (row[i + 1] < isoLevel) cubeIndex |= 2;
+			if (rowY[i + 1] < isoLevel) cubeIndex |= 4;
+			if (rowY[i] < isoLevel) cubeIndex |= 8;
+			if (rowZ[i] < isoLevel) cubeIndex |= 16;
+			if (rowZ[i + 1] < isoLevel) cubeIndex |= 32;
+			if (rowYZ[i + 1] < isoLevel) cubeIndex |= 64;
+			if (rowYZ[i] < isoLevel) cubeIndex |= 128;
+			cubeIndices[i] = static_cast<unsigned char>(cubeIndex);
+			inside &= cubeIndex;
+			outside |= cubeIndex;
+		}
+	}
+
+	// A row is only uniform if all of its cubes are 255 or all of them are 0,
+	// as two neighbouring cubes share four corners and can't be 0 and 255 next to each other.
+	bool isActive(unsigned int inside, unsigned int outside) {
+		return inside != 255 && outside != 0;
+	}
+
+	bool classifyRowScalar(const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int count, float isoLevel, unsigned char* cubeIndices) {
+		unsigned int inside = 255, outside = 0;
+		classifyScalar(row, rowY, rowZ, rowYZ, 0, count, isoLevel, cubeIndices, inside, outside);
+		return isActive(inside, outside);
+	}
+
+#ifdef MESHING_KERNELS_X86
+	// Sets the bit of a corner in every lane whose density is below the isoLevel
+	MESHING_KERNELS_TARGET("sse4.1") inline __m128i cornerBitsSSE4(const float* corners, __m128 isoLevel, int bit) {
+		return _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(corners), isoLevel)), _mm_set1_epi32(bit));
+	}
+
+	MESHING_KERNELS_TARGET("sse4.1") bool classifyRowSSE4(const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int count, float isoLevel, unsigned char* cubeIndices) {
+		const __m128 iso = _mm_set1_ps(isoLevel);
+		__m128i inside = _mm_set1_epi32(255), outside = _mm_setzero_si128();
+
+		// Four cubes at a time, every corner of the cube is a load of one of the rows with or without an offset of one
+		int i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128i cubeIndex = _mm_or_si128(
+				_mm_or_si128(_mm_or_si128(cornerBitsSSE4(row + i, iso, 1), cornerBitsSSE4(row + i + 1, iso, 2)),
+					_mm_or_si128(cornerBitsSSE4(rowY + i + 1, iso, 4), cornerBitsSSE4(rowY + i, iso, 8))),
+				_mm_or_si128(_mm_or_si128(cornerBitsSSE4(rowZ + i, iso, 16), cornerBitsSSE4(rowZ + i + 1, iso, 32)),
+					_mm_or_si128(cornerBitsSSE4(rowYZ + i + 1, iso, 64), cornerBitsSSE4(rowYZ + i, iso, 128))));
+			inside = _mm_and_si128(inside, cubeIndex);
+			outside = _mm_or_si128(outside, cubeIndex);
+
+			// Narrow the four 32 bit indices down to bytes
+			__m128i packed = _mm_packus_epi16(_mm_packus_epi32(cubeIndex, cubeIndex), _mm_setzero_si128());
+			int bytes = _mm_cvtsi128_si32(packed);
+			memcpy(cubeIndices + i, &bytes, 4);
+		}
+
+		unsigned int lanes[2][4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes[0]), inside);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes[1]), outside);
+		unsigned int insideAll = lanes[0][0] & lanes[0][1] & lanes[0][2] & lanes[0][3];
+		unsigned int outsideAll = lanes[1][0] | lanes[1][1] | lanes[1][2] | lanes[1][3];
+
+		classifyScalar(row, rowY, rowZ, rowYZ, i, count, isoLevel, cubeIndices, insideAll, outsideAll);
+		return isActive(insideAll, outsideAll);
+	}
+
+	MESHING_KERNELS_TARGET("avx2") inline __m256i cornerBitsAVX2(const float* corners, __m256 isoLevel, int bit) {
+		return _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(corners), isoLevel, _CMP_LT_OQ)), _mm256_set1_epi32(bit));
+	}
+
+	MESHING_KERNELS_TARGET("avx2") bool classifyRowAVX2(const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int count, float isoLevel, unsigned char* cubeIndices) {
+		const __m256 iso = _mm256_set1_ps(isoLevel);
+		__m256i inside = _mm256_set1_epi32(255), outside = _mm256_setzero_si256();
+
+		// Eight cubes at a time, the same way as the SSE4 version
+		int i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256i cubeIndex = _mm256_or_si256(
+				_mm256_or_si256(_mm256_or_si256(cornerBitsAVX2(row + i, iso, 1), cornerBitsAVX2(row + i + 1, iso, 2)),
+					_mm256_or_si256(cornerBitsAVX2(rowY + i + 1, iso, 4), cornerBitsAVX2(rowY + i, iso, 8))),
+				_mm256_or_si256(_mm256_or_si256(cornerBitsAVX2(rowZ + i, iso, 16), cornerBitsAVX2(rowZ + i + 1, iso, 32)),
+					_mm256_or_si256(cornerBitsAVX2(rowYZ + i + 1, iso, 64), cornerBitsAVX2(rowYZ + i, iso, 128))));
+			inside = _mm256_and_si256(inside, cubeIndex);
+			outside = _mm256_or_si256(outside, cubeIndex);
+
+			// Narrow the eight 32 bit indices down to bytes, the two 128 bit halves are packed separately to keep them in order
+			__m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(cubeIndex), _mm256_extracti128_si256(cubeIndex, 1));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(cubeIndices + i), _mm_packus_epi16(packed, packed));
+		}
+
+		unsigned int lanes[2][8];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes[0]), inside);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes[1]), outside);
+		unsigned int insideAll = 255, outsideAll = 0;
+		for (int lane = 0; lane < 8; lane++) {
+			insideAll &= lanes[0][lane];
+			outsideAll |= lanes[1][lane];
+		}
+		_mm256_zeroupper(); // The scalar tail is not compiled for AVX, and mixing the two without this is very slow
+
+		classifyScalar(row, rowY, rowZ, rowYZ, i, count, isoLevel, cubeIndices, insideAll, outsideAll);
+		return isActive(insideAll, outsideAll);
+	}
+#endif
+
+	ClassifyFunction getClassifyFunction(MeshingKernels::Instructions instructions) {
+		switch (instructions) {
+#ifdef MESHING_KERNELS_X86
+		case MeshingKernels::Instructions::sse4: return classifyRowSSE4;
+		case MeshingKernels::Instructions::avx2: return classifyRowAVX2;
+#endif
+		default: return classifyRowScalar;
+		}
+	}
+
+	// Picked once when the program starts
+	const ClassifyFunction bestClassifyFunction = getClassifyFunction(MeshingKernels::getBestInstructions());
+}
+
+bool MeshingKernels::isSupported(Instructions instructions) {
+	if (instructions == Instructions::scalar) return true;
+
+#if defined(MESHING_KERNELS_X86) && defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 1);
+	bool sse4 = (info[2] & (1 << 19)) != 0;
+	if (instructions == Instructions::sse4) return sse4;
+
+	// AVX also needs the OS to save the 256 bit registers
+	bool osSavesAVX = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+	__cpuidex(info, 7, 0);
+	return osSavesAVX && (info[1] & (1 << 5)) != 0;
+#elif defined(MESHING_KERNELS_X86)
+	if (instructions == Instructions::sse4) return __builtin_cpu_supports("sse4.1");
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+MeshingKernels::Instructions MeshingKernels::getBestInstructions() {
+	if (isSupported(Instructions::avx2)) return Instructions::avx2;
+	if (isSupported(Instructions::sse4)) return Instructions::sse4;
+	return Instructions::scalar;
+}
+
+const char* MeshingKernels::getName(Instructions instructions) {
+	switch (instructions) {
+	case Instructions::sse4: return "SSE4.1";
+	case Instructions::avx2: return "AVX2";
+	default: return "Scalar";
+	}
+}
+
+void MeshingKernels::gradientRow(const float* row, const float* rowYMinus, const float* rowYPlus, const float* rowZMinus, const float* rowZPlus,
+	int count, float* gradientX, float* gradientY, float* gradientZ)
+{
+	int i = 0;
+
+#ifdef MESHING_KERNELS_SSE2
+	// Four corners at a time, the neighbours along x are just the row shifted by one
+	const __m128 half = _mm_set1_ps(0.5f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(row + i + 1), _mm_loadu_ps(row + i - 1));
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(rowYPlus + i), _mm_loadu_ps(rowYMinus + i));
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(rowZPlus + i), _mm_loadu_ps(rowZMinus + i));
+		_mm_storeu_ps(gradientX + i, _mm_mul_ps(dx, half));
+		_mm_storeu_ps(gradientY + i, _mm_mul_ps(dy, half));
+		_mm_storeu_ps(gradientZ + i, _mm_mul_ps(dz, half));
+	}
+#endif
+
+	// The remaining corners (or all of them without SSE2)
+	for (; i < count; i++) {
+		gradientX[i] = (row[i + 1] - row[i - 1]) * 0.5f;
+		gradientY[i] = (rowYPlus[i] - rowYMinus[i]) * 0.5f;
+		gradientZ[i] = (rowZPlus[i] - rowZMinus[i]) * 0.5f;
+	}
+}
+
+bool MeshingKernels::classifyRow(const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int count, float isoLevel, unsigned char* cubeIndices) {
+	return bestClassifyFunction(row, rowY, rowZ, rowYZ, count, isoLevel, cubeIndices);
+}
+
+bool MeshingKernels::classifyRow(Instructions instructions, const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int count, float isoLevel, unsigned char* cubeIndices) {
+	return getClassifyFunction(instructions)(row, rowY, rowZ, rowYZ, count, isoLevel, cubeIndices);
+}
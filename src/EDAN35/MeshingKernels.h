@@ -0,0 +1,28 @@
+#pragma once
+
+/// Vectorised inner loops used by TerrainMesh to process a whole row of corners at once.
+/// Every kernel has a plain C++ fallback for compilers or CPUs without the required instructions.
+///
+namespace MeshingKernels {
+	// The instruction sets the kernels can be run with, the best one the CPU supports is picked at runtime
+	enum class Instructions : unsigned int {
+		scalar,
+		sse4,
+		avx2
+	};
+
+	bool isSupported(Instructions instructions); // Whether this build and the CPU it runs on can use the instructions
+	Instructions getBestInstructions();
+	const char* getName(Instructions instructions);
+
+	// Computes the central difference gradient of count densities along a row in +x.
+	// row[-1] and row[count] have to be readable, as do the count values of the four neighbouring rows.
+	// The gradient components are written to gradientX, gradientY and gradientZ.
+	void gradientRow(const float* row, const float* rowYMinus, const float* rowYPlus, const float* rowZMinus, const float* rowZPlus,
+		int count, float* gradientX, float* gradientY, float* gradientZ);
+
+	// Computes the marching cubes index of count cubes along a row in +x, from the count + 1 corners of each of the four rows of corners around them.
+	// Returns false if every cube is entirely inside or entirely outside the surface (index 0 or 255), in which case the whole row can be skipped.
+	bool classifyRow(const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int count, float isoLevel, unsigned char* cubeIndices);
+	bool classifyRow(Instructions instructions, const float* row, const float* rowY, const float* rowZ, const float* rowYZ, int count, float isoLevel, unsigned char* cubeIndices);
+}
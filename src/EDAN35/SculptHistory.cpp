@@ -0,0 +1,170 @@
+#include "SculptHistory.h"
+#include "TerrainGrid.h"
+#include <glm/glm.hpp>
+#include <utility>
+
+SculptHistory::SculptHistory(TerrainGrid* grid, size_t memoryLimit)
+	: grid(grid), memoryUsage(0), memoryLimit(memoryLimit)
+{
+}
+
+void SculptHistory::recordBricks(glm::ivec3 voxelMin, glm::ivec3 voxelMax) {
+	if (voxelMin.x >= voxelMax.x || voxelMin.y >= voxelMax.y || voxelMin.z >= voxelMax.z) return;
+
+	glm::ivec3 counts = grid->getVoxelBrickCounts();
+	glm::ivec3 first = glm::max(voxelMin, glm::ivec3(0)) / TerrainGrid::BRICK_SIZE;
+	glm::ivec3 last = glm::min((voxelMax - glm::ivec3(1)) / TerrainGrid::BRICK_SIZE, counts - glm::ivec3(1));
+	for (int bz = first.z; bz <= last.z; bz++) {
+		for (int by = first.y; by <= last.y; by++) {
+			for (int bx = first.x; bx <= last.x; bx++) {
+				// Only the voxels from before the stroke touched the brick matter
+				if (!recordedIndices.insert((bz * counts.y + by) * counts.x + bx).second) continue;
+
+				RecordedBrick recorded;
+				recorded.brick = glm::ivec3(bx, by, bz);
+				recorded.voxels.resize(TerrainGrid::BRICK_VOXELS);
+				grid->copyBrick(recorded.brick, recorded.voxels.data());
+				recordedBricks.push_back(std::move(recorded));
+			}
+		}
+	}
+}
+
+void SculptHistory::endStroke() {
+	if (recordedBricks.empty()) return;
+
+	Stroke stroke;
+	stroke.bytes = sizeof(Stroke);
+	scratch.resize(TerrainGrid::BRICK_VOXELS);
+	for (const RecordedBrick& recorded : recordedBricks) {
+		grid->copyBrick(recorded.brick, scratch.data());
+		BrickDelta delta;
+		delta.brick = recorded.brick;
+		encodeDelta(recorded.voxels.data(), scratch.data(), delta.runs);
+		if (delta.runs.empty()) continue; // The brush reached the brick without changing it
+		stroke.bytes += sizeof(BrickDelta) + delta.runs.size();
+		stroke.bricks.push_back(std::move(delta));
+	}
+	recordedBricks.clear();
+	recordedIndices.clear();
+	if (stroke.bricks.empty()) return;
+
+	// A new stroke replaces the strokes that were undone
+	for (const Stroke& undone : redoStrokes) {
+		memoryUsage -= undone.bytes;
+	}
+	redoStrokes.clear();
+	memoryUsage += stroke.bytes;
+	undoStrokes.push_back(std::move(stroke));
+	trim();
+}
+
+bool SculptHistory::undo() {
+	endStroke();
+	if (undoStrokes.empty()) return false;
+
+	apply(undoStrokes.back());
+	redoStrokes.push_back(std::move(undoStrokes.back()));
+	undoStrokes.pop_back();
+	return true;
+}
+
+bool SculptHistory::redo() {
+	endStroke();
+	if (redoStrokes.empty()) return false;
+
+	apply(redoStrokes.back());
+	undoStrokes.push_back(std::move(redoStrokes.back()));
+	redoStrokes.pop_back();
+	return true;
+}
+
+void SculptHistory::clear() {
+	undoStrokes.clear();
+	redoStrokes.clear();
+	recordedBricks.clear();
+	recordedIndices.clear();
+	memoryUsage = 0;
+}
+
+size_t SculptHistory::getUndoCount() const {
+	return undoStrokes.size();
+}
+
+size_t SculptHistory::getRedoCount() const {
+	return redoStrokes.size();
+}
+
+size_t SculptHistory::getMemoryUsage() const {
+	return memoryUsage;
+}
+
+void SculptHistory::setMemoryLimit(size_t bytes) {
+	memoryLimit = bytes;
+	trim();
+}
+
+size_t SculptHistory::getMemoryLimit() const {
+	return memoryLimit;
+}
+
+void SculptHistory::encodeDelta(const float* before, const float* after, std::vector<unsigned char>& runs) {
+	const unsigned char* a = reinterpret_cast<const unsigned char*>(before);
+	const unsigned char* b = reinterpret_cast<const unsigned char*>(after);
+	const size_t size = TerrainGrid::BRICK_VOXELS * sizeof(float);
+	runs.clear();
+	size_t i = 0;
+	while (i < size) {
+		size_t unchanged = 0;
+		while (i < size && a[i] == b[i] && unchanged < 255) {
+			unchanged++;
+			i++;
+		}
+		size_t changed = 0;
+		while (i + changed < size && a[i + changed] != b[i + changed] && changed < 255) {
+			changed++;
+		}
+		if (changed == 0 && i == size) break; // The unchanged bytes at the end are left out
+
+		runs.push_back(static_cast<unsigned char>(unchanged));
+		runs.push_back(static_cast<unsigned char>(changed));
+		for (size_t k = 0; k < changed; k++, i++) {
+			runs.push_back(a[i] ^ b[i]);
+		}
+	}
+	runs.shrink_to_fit();
+}
+
+void SculptHistory::applyDelta(const std::vector<unsigned char>& runs, float* voxels) {
+	unsigned char* bytes = reinterpret_cast<unsigned char*>(voxels);
+	size_t position = 0;
+	for (size_t i = 0; i + 1 < runs.size();) {
+		position += runs[i];
+		size_t changed = runs[i + 1];
+		i += 2;
+		for (size_t k = 0; k < changed; k++) {
+			bytes[position++] ^= runs[i++];
+		}
+	}
+}
+
+void SculptHistory::apply(const Stroke& stroke) {
+	scratch.resize(TerrainGrid::BRICK_VOXELS);
+	for (const BrickDelta& delta : stroke.bricks) {
+		grid->copyBrick(delta.brick, scratch.data());
+		applyDelta(delta.runs, scratch.data());
+		grid->replaceBrick(delta.brick, scratch.data());
+	}
+}
+
+void SculptHistory::trim() {
+	while (memoryUsage > memoryLimit && !undoStrokes.empty()) {
+		memoryUsage -= undoStrokes.front().bytes;
+		undoStrokes.pop_front();
+	}
+	// The redo furthest in the future is the first one that was undone
+	while (memoryUsage > memoryLimit && !redoStrokes.empty()) {
+		memoryUsage -= redoStrokes.front().bytes;
+		redoStrokes.pop_front();
+	}
+}
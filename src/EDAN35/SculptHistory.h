@@ -0,0 +1,76 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+#include <cstddef>
+#include <deque>
+#include <unordered_set>
+#include <vector>
+
+class TerrainGrid;
+
+///
+/// The undo and redo history of the sculpting of a TerrainGrid.
+///
+/// A stroke is everything sculpted between two calls to endStroke(). While it is sculpted, the grid hands every brick
+/// to recordBricks() before it changes it for the first time, and the history keeps a copy of the brick's voxels.
+/// When the stroke ends, only the difference to the new voxels is kept: the bytes of the old and new voxels XORed together,
+/// which are zero wherever the brush didn't change anything, with the runs of zeros left out. The same difference turns
+/// the new voxels back into the old ones and the old ones into the new ones, so undo and redo only touch the bricks of the stroke.
+///
+/// The copies are made with TerrainGrid::copyBrick(), whose voxels outside of the grid are always 0, so flushChanges() compacting a brick
+/// before or after endStroke() doesn't change the difference.
+///
+/// The oldest strokes are forgotten once the history uses more memory than its limit.
+///
+class SculptHistory {
+public:
+	SculptHistory() = delete; // No default constructor, we require a TerrainGrid to be provided
+	SculptHistory(TerrainGrid* grid, size_t memoryLimit);
+
+	// Keeps a copy of the bricks around the voxels [voxelMin, voxelMax) that the current stroke hasn't changed yet, before they change
+	void recordBricks(glm::ivec3 voxelMin, glm::ivec3 voxelMax);
+	void endStroke(); // Adds the current stroke to the history, if it changed anything
+
+	bool undo(); // Reverts the last stroke, returns false when there is nothing to undo
+	bool redo(); // Applies the last undone stroke again, returns false when there is nothing to redo
+	void clear(); // Forgets every stroke, e.g. when the grid is regenerated and the strokes no longer fit it
+
+	size_t getUndoCount() const;
+	size_t getRedoCount() const;
+	size_t getMemoryUsage() const; // The bytes used by the strokes in the history, without the copies of the current stroke
+	void setMemoryLimit(size_t bytes);
+	size_t getMemoryLimit() const;
+
+private:
+	// The XORed bytes of the voxels of a brick before and after a stroke, as runs of a byte with the amount of unchanged bytes,
+	// a byte with the amount of changed bytes, and the changed bytes themselves
+	struct BrickDelta {
+		glm::ivec3 brick;
+		std::vector<unsigned char> runs;
+	};
+
+	struct Stroke {
+		std::vector<BrickDelta> bricks;
+		size_t bytes; // The memory the stroke uses
+	};
+
+	// The voxels of a brick from before the current stroke changed it
+	struct RecordedBrick {
+		glm::ivec3 brick;
+		std::vector<float> voxels;
+	};
+
+	static void encodeDelta(const float* before, const float* after, std::vector<unsigned char>& runs);
+	static void applyDelta(const std::vector<unsigned char>& runs, float* voxels);
+	void apply(const Stroke& stroke); // Swaps the voxels of the stroke's bricks between before and after it
+	void trim(); // Forgets the strokes furthest from the current state until the history fits in its memory limit
+
+	TerrainGrid* grid;
+	std::deque<Stroke> undoStrokes; // The oldest first
+	std::deque<Stroke> redoStrokes; // The one undone last at the back
+	std::vector<RecordedBrick> recordedBricks; // The bricks of the current stroke
+	std::unordered_set<int> recordedIndices; // The indices of the bricks of the current stroke in the grid
+	std::vector<float> scratch; // The voxels of a brick while a delta is applied to it
+	size_t memoryUsage;
+	size_t memoryLimit;
+};
@@ -14,34 +14,40 @@ bool SculptingRaycaster::cast(FPSCameraf* camera, bool destructive, float size,
 	glm::vec3 direction = camera->mWorld.GetFront();
 
 	// Cast the ray
-	bool hit = false;
-	glm::vec3 rayPos = origin / terrain->getScale(); // Divide by the scale to get to array-index space
+	glm::vec3 rayPos;
+	bool hit = march(*terrain, origin, direction, destructive, rayPos);
+	if (hit) {
+		// Sculpt the terrain around the voxel the ray stopped at
+		terrain->sculpt(glm::round(rayPos), camera, size, strength, destructive);
+	}
+
+	// Update the VBO for drawing the debug line
+	updateVBO(hit, destructive, origin, rayPos * terrain->getScale());
+	return hit;
+}
+
+
+bool SculptingRaycaster::march(const TerrainGrid& terrain, glm::vec3 origin, glm::vec3 direction, bool destructive, glm::vec3& end) {
+	glm::vec3 rayPos = origin / terrain.getScale(); // Divide by the scale to get to array-index space
 	for (int i = 0; i < 1000; i++) {
 		// Check if the closest voxel to the ray is in the terrain
 		glm::vec3 closestVoxel = glm::round(rayPos);
 		// Check if the voxel is part of the TerrainGrid (if it is out of bound, the get() function returns false)
-		if (destructive && (terrain->get(closestVoxel) > 0)) {
-			// Sculpt the terrain
-			terrain->sculpt(closestVoxel, camera, size, strength, destructive);
-			hit = true;
-			break; // Break from the loop, as we have now sculpted the terrain
+		if (destructive && (terrain.get(closestVoxel) > 0)) {
+			end = rayPos;
+			return true;
 		}
-		if (!destructive && (terrain->get(closestVoxel) > 0.7)) {
-			// Sculpt the terrain
-			terrain->sculpt(closestVoxel, camera, size, strength, destructive);
-			hit = true;
-			break; // Break from the loop, as we have now sculpted the terrain
+		if (!destructive && (terrain.get(closestVoxel) > 0.7)) {
+			end = rayPos;
+			return true;
 		}
 		// Move the ray forward
 		rayPos += direction;
 	}
-
-	// Update the VBO for drawing the debug line
-	updateVBO(hit, destructive, origin, rayPos * terrain->getScale());
-	return hit;
+	end = rayPos;
+	return false;
 }
 
-
 void SculptingRaycaster::drawRays(FPSCameraf* camera, GLuint shader) {
 	if (debug_lines_vao == 0) {
 		return;
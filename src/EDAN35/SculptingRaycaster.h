@@ -18,6 +18,9 @@ public:
 	// Returns TRUE if any terrain was hit.
 	// If destructive == true, terrain is removed, otherwise terrain is added. "size" is the radius of the brush
 	bool cast(FPSCameraf* camera,  bool desctructive, float size, float strength); 
+	// Marches a ray from origin (in world space) along direction until it reaches a voxel that cast() would sculpt, without sculpting or drawing anything.
+	// Returns TRUE if it did, end is where the ray stopped in array-index space.
+	static bool march(const TerrainGrid& terrain, glm::vec3 origin, glm::vec3 direction, bool destructive, glm::vec3& end);
 
 	void drawRays(FPSCameraf* camera, GLuint shader); // Draws a debug line for the rays 
 
@@ -0,0 +1,283 @@
+// Headless benchmark of the terrain code, without a window or OpenGL context.
+// Runs the grid generation, noise sampling, full and incremental meshing and raycasting on the CPU,
+// and prints their throughput and the peak memory use as JSON so that releases can be compared.
+//
+// Usage: terrain_bench [--sizes 64,128,256] [--height 128] [--threads 1,4] [--sculpts 100] [--rays 100000] [--seed 0] [--precision float32|unorm16|unorm8]
+
+#include "TerrainGrid.h"
+#include "TerrainMesh.h"
+#include "PerlinNoise.h"
+#include "SculptingRaycaster.h"
+#include "SculptHistory.h"
+#include "WorkerPool.h"
+#include "core/Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#	define NOMINMAX
+#	include <windows.h>
+#	include <psapi.h>
+#else
+#	include <sys/resource.h>
+#endif
+
+namespace {
+	struct Options {
+		std::vector<int> sizes = { 64, 128, 256 }; // The grid is size x height x size voxels
+		int height = 128;
+		std::vector<int> threads;
+		int sculpts = 100;
+		int rays = 100000;
+		int seed = 0;
+		TerrainGrid::Precision precision = TerrainGrid::Precision::float32; // How the grid stores its voxels
+	};
+
+	const char* precisionNames[] = { "float32", "unorm16", "unorm8" }; // In the order of TerrainGrid::Precision
+
+	bool parsePrecision(const char* text, TerrainGrid::Precision& precision) {
+		for (int i = 0; i < 3; i++) {
+			if (!strcmp(text, precisionNames[i])) {
+				precision = static_cast<TerrainGrid::Precision>(i);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	double secondsSince(std::chrono::high_resolution_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// The largest amount of memory the process used so far, in bytes
+	size_t peakMemory() {
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.PeakWorkingSetSize;
+		return 0;
+#else
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#	ifdef __APPLE__
+		return static_cast<size_t>(usage.ru_maxrss); // Already in bytes
+#	else
+		return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#	endif
+#endif
+	}
+
+	std::vector<int> parseList(const char* text) {
+		std::vector<int> values;
+		for (const char* p = text; *p;) {
+			char* next;
+			long value = std::strtol(p, &next, 10);
+			if (next == p) break;
+			values.push_back(static_cast<int>(value));
+			p = *next == ',' ? next + 1 : next;
+		}
+		return values;
+	}
+
+	bool parseOptions(int argc, char** argv, Options& options) {
+		for (int i = 1; i < argc; i++) {
+			bool hasValue = i + 1 < argc;
+			if (!strcmp(argv[i], "--sizes") && hasValue) options.sizes = parseList(argv[++i]);
+			else if (!strcmp(argv[i], "--height") && hasValue) options.height = std::atoi(argv[++i]);
+			else if (!strcmp(argv[i], "--threads") && hasValue) options.threads = parseList(argv[++i]);
+			else if (!strcmp(argv[i], "--sculpts") && hasValue) options.sculpts = std::atoi(argv[++i]);
+			else if (!strcmp(argv[i], "--rays") && hasValue) options.rays = std::atoi(argv[++i]);
+			else if (!strcmp(argv[i], "--seed") && hasValue) options.seed = std::atoi(argv[++i]);
+			else if (!strcmp(argv[i], "--precision") && hasValue && parsePrecision(argv[i + 1], options.precision)) i++;
+			else {
+				std::fprintf(stderr, "Usage: %s [--sizes 64,128,256] [--height 128] [--threads 1,4] [--sculpts 100] [--rays 100000] [--seed 0] [--precision float32|unorm16|unorm8]\n", argv[0]);
+				return false;
+			}
+		}
+		if (options.threads.empty()) options.threads.push_back(WorkerPool::getMaxWorkerCount());
+		for (int size : options.sizes) {
+			if (size < 1) return false;
+		}
+		return options.height >= 1 && !options.threads.empty();
+	}
+
+	// Every chunk of the grid, split the same way as TerrainMesh does
+	std::vector<std::pair<glm::ivec3, glm::ivec3>> chunksOf(glm::ivec3 cubeMin, glm::ivec3 cubeMax) {
+		std::vector<std::pair<glm::ivec3, glm::ivec3>> chunks;
+		for (int z = cubeMin.z; z < cubeMax.z; z += TerrainMesh::CHUNK_SIZE) {
+			for (int y = cubeMin.y; y < cubeMax.y; y += TerrainMesh::CHUNK_SIZE) {
+				for (int x = cubeMin.x; x < cubeMax.x; x += TerrainMesh::CHUNK_SIZE) {
+					glm::ivec3 origin(x, y, z);
+					chunks.push_back({ origin, glm::min(origin + glm::ivec3(TerrainMesh::CHUNK_SIZE), cubeMax) });
+				}
+			}
+		}
+		return chunks;
+	}
+
+	struct MeshStats {
+		size_t cubes = 0;
+		size_t triangles = 0;
+	};
+
+	// Meshes the chunks on all workers, each from a snapshot of only the voxels around it
+	MeshStats meshChunks(WorkerPool& workers, const TerrainGrid& grid, TerrainMesh::Algorithm algorithm,
+		const std::vector<std::pair<glm::ivec3, glm::ivec3>>& chunks, std::vector<size_t>& triangles) {
+		MeshStats stats;
+		if (chunks.empty()) return stats;
+
+		triangles.assign(chunks.size(), 0);
+		workers.parallelFor(static_cast<int>(chunks.size()), [&](int i) {
+			thread_local std::vector<float> vertices;
+			thread_local std::vector<unsigned int> indices;
+			thread_local TerrainGrid::Snapshot snapshot;
+			grid.copyRegion(glm::max(chunks[i].first - glm::ivec3(1), glm::ivec3(0)), glm::min(chunks[i].second + glm::ivec3(2), grid.getDimensions()), snapshot);
+			TerrainMesh::generateRegion(snapshot, 0.5f, algorithm, false, TerrainMesh::NormalMode::face, chunks[i].first, chunks[i].second, vertices, indices);
+			triangles[i] = indices.empty() ? vertices.size() / 18 : indices.size() / 3;
+		});
+		for (size_t i = 0; i < chunks.size(); i++) {
+			glm::ivec3 size = chunks[i].second - chunks[i].first;
+			stats.cubes += static_cast<size_t>(size.x) * size.y * size.z;
+			stats.triangles += triangles[i];
+		}
+		return stats;
+	}
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	if (!parseOptions(argc, argv, options)) return 1;
+
+	// Only the JSON goes to the standard output
+	Log::Init();
+	Log::SetOutputTargets(0);
+
+	const char* algorithmNames[] = { "marching_cubes", "surface_nets" }; // In the order of TerrainMesh::Algorithm
+	FPSCameraf camera(0.5f, 1.0f, 0.01f, 1000.0f); // Sculpting only uses its position
+
+	std::printf("{\n\t\"hardware_threads\": %d,\n\t\"precision\": \"%s\",\n\t\"layout\": \"%s\",\n\t\"results\": [", WorkerPool::getMaxWorkerCount(),
+		precisionNames[static_cast<int>(options.precision)], TerrainGrid::getLayoutName());
+	for (size_t s = 0; s < options.sizes.size(); s++) {
+		glm::ivec3 dimensions(options.sizes[s], options.height, options.sizes[s]);
+		double voxels = static_cast<double>(dimensions.x) * dimensions.y * dimensions.z;
+		std::printf("%s\n\t\t{\n\t\t\t\"dimensions\": [%d, %d, %d],\n", s > 0 ? "," : "", dimensions.x, dimensions.y, dimensions.z);
+
+		// Generation fills the grid from the noise and computes the brick ranges
+		auto start = std::chrono::high_resolution_clock::now();
+		TerrainGrid grid(dimensions, 1.0f);
+		grid.setPrecision(options.precision);
+		grid.flushChanges();
+		double seconds = secondsSince(start);
+		std::printf("\t\t\t\"generation\": { \"seconds\": %.6f, \"voxels_per_second\": %.0f, \"grid_bytes\": %zu },\n", seconds, voxels / seconds, grid.getMemoryUsage());
+
+		// Noise sampling on its own, one sample per column like the generation
+		PerlinNoise noise(options.seed, 0.05f);
+		float checksum = 0.0f;
+		start = std::chrono::high_resolution_clock::now();
+		for (int z = 0; z < dimensions.z; z++) {
+			for (int x = 0; x < dimensions.x; x++) {
+				checksum += noise.sampleNoise(x, z);
+			}
+		}
+		seconds = secondsSince(start);
+		double samples = static_cast<double>(dimensions.x) * dimensions.z;
+		std::printf("\t\t\t\"noise\": { \"samples\": %.0f, \"seconds\": %.6f, \"samples_per_second\": %.0f, \"checksum\": %.3f },\n", samples, seconds, samples / seconds, checksum);
+
+		// Rays from random points above the terrain, in random downward directions
+		std::mt19937 random(options.seed);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		int hits = 0;
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < options.rays; i++) {
+			glm::vec3 origin(unit(random) * dimensions.x, dimensions.y + 1.0f, unit(random) * dimensions.z);
+			glm::vec3 direction = glm::normalize(glm::vec3(unit(random) - 0.5f, -1.0f, unit(random) - 0.5f));
+			glm::vec3 end;
+			hits += SculptingRaycaster::march(grid, origin, direction, i % 2 == 0, end) ? 1 : 0;
+		}
+		seconds = secondsSince(start);
+		std::printf("\t\t\t\"raycasting\": { \"rays\": %d, \"hits\": %d, \"seconds\": %.6f, \"rays_per_second\": %.0f },\n",
+			options.rays, hits, seconds, options.rays / std::max(seconds, 1e-9));
+
+		std::printf("\t\t\t\"meshing\": [");
+		bool first = true;
+		std::vector<size_t> triangles;
+		for (int threads : options.threads) {
+			WorkerPool workers(std::max(threads, 1));
+			for (TerrainMesh::Algorithm algorithm : { TerrainMesh::Algorithm::marchingCubes, TerrainMesh::Algorithm::surfaceNets }) {
+				// Full meshing, including the snapshots of the chunks
+				auto allChunks = chunksOf(glm::ivec3(0), dimensions - glm::ivec3(1));
+				start = std::chrono::high_resolution_clock::now();
+				MeshStats full = meshChunks(workers, grid, algorithm, allChunks, triangles);
+				double fullSeconds = secondsSince(start);
+
+				// Incremental meshing: sculpt, then remesh the chunks around the changed voxels like TerrainMesh::updateRegion() does.
+				// Every configuration sculpts a fresh copy of the terrain with the same brushes.
+				TerrainGrid sculpted(dimensions, 1.0f);
+				sculpted.setPrecision(options.precision);
+				sculpted.flushChanges();
+				// Every edit is a stroke of the undo history, which is part of the cost of sculpting. The limit keeps every stroke.
+				SculptHistory history(&sculpted, static_cast<size_t>(-1));
+				sculpted.setHistory(&history);
+				std::vector<std::pair<glm::ivec3, glm::ivec3>> regions; // The voxels each edit changed, from the update callbacks
+				sculpted.registerUpdateCallback([&regions](glm::ivec3 regionMin, glm::ivec3 regionMax) { regions.emplace_back(regionMin, regionMax); });
+				std::mt19937 brushes(options.seed);
+				MeshStats incremental;
+				double sculptSeconds = 0.0;
+				double meshSeconds = 0.0;
+				for (int i = 0; i < options.sculpts; i++) {
+					glm::ivec3 center(static_cast<int>(unit(brushes) * dimensions.x), static_cast<int>(unit(brushes) * dimensions.y), static_cast<int>(unit(brushes) * dimensions.z));
+					camera.mWorld.SetTranslate(glm::vec3(center) + glm::vec3(0.0f, 20.0f, 0.0f));
+					regions.clear();
+					start = std::chrono::high_resolution_clock::now();
+					sculpted.sculpt(center, &camera, 5.0f, 0.3f, i % 3 == 0);
+					sculpted.flushChanges(); // Like the application does once per frame, which ends a stroke the frame after its last sculpt
+					history.endStroke();
+					sculptSeconds += secondsSince(start);
+
+					start = std::chrono::high_resolution_clock::now();
+					std::vector<std::pair<glm::ivec3, glm::ivec3>> changed;
+					for (const auto& region : regions) { // No region when the brush didn't change any voxel
+						glm::ivec3 chunkMin = glm::max(region.first - glm::ivec3(2), glm::ivec3(0)) / TerrainMesh::CHUNK_SIZE * TerrainMesh::CHUNK_SIZE;
+						glm::ivec3 chunkMax = glm::min(region.second + glm::ivec3(1), dimensions - glm::ivec3(1));
+						for (const auto& chunk : chunksOf(chunkMin, dimensions - glm::ivec3(1))) {
+							if (chunk.first.x < chunkMax.x && chunk.first.y < chunkMax.y && chunk.first.z < chunkMax.z) changed.push_back(chunk);
+						}
+					}
+					MeshStats stats = meshChunks(workers, sculpted, algorithm, changed, triangles);
+					meshSeconds += secondsSince(start);
+					incremental.cubes += stats.cubes;
+					incremental.triangles += stats.triangles;
+				}
+
+				// Undo every stroke, which only touches the bricks the strokes changed
+				size_t strokes = history.getUndoCount();
+				size_t historyBytes = history.getMemoryUsage();
+				start = std::chrono::high_resolution_clock::now();
+				while (history.undo()) {
+					sculpted.flushChanges();
+				}
+				double undoSeconds = secondsSince(start);
+
+				std::printf("%s\n\t\t\t\t{\n\t\t\t\t\t\"threads\": %d,\n\t\t\t\t\t\"algorithm\": \"%s\",\n", first ? "" : ",", workers.getWorkerCount(), algorithmNames[static_cast<int>(algorithm)]);
+				std::printf("\t\t\t\t\t\"full\": { \"seconds\": %.6f, \"cubes\": %zu, \"cubes_per_second\": %.0f, \"triangles\": %zu, \"triangles_per_second\": %.0f },\n",
+					fullSeconds, full.cubes, full.cubes / fullSeconds, full.triangles, full.triangles / fullSeconds);
+				std::printf("\t\t\t\t\t\"sculpt\": { \"edits\": %d, \"sculpt_seconds\": %.6f, \"mesh_seconds\": %.6f, \"milliseconds_per_edit\": %.3f, \"cubes_per_second\": %.0f, \"triangles_per_second\": %.0f },\n",
+					options.sculpts, sculptSeconds, meshSeconds, 1000.0 * (sculptSeconds + meshSeconds) / std::max(options.sculpts, 1),
+					incremental.cubes / std::max(meshSeconds, 1e-9), incremental.triangles / std::max(meshSeconds, 1e-9));
+				std::printf("\t\t\t\t\t\"undo\": { \"strokes\": %zu, \"history_bytes\": %zu, \"bytes_per_stroke\": %.0f, \"seconds\": %.6f, \"milliseconds_per_stroke\": %.3f }\n\t\t\t\t}",
+					strokes, historyBytes, double(historyBytes) / std::max(strokes, size_t(1)), undoSeconds, 1000.0 * undoSeconds / std::max(strokes, size_t(1)));
+				first = false;
+			}
+		}
+		std::printf("\n\t\t\t]\n\t\t}");
+		std::fflush(stdout);
+	}
+	std::printf("\n\t],\n\t\"peak_memory_bytes\": %zu\n}\n", peakMemory());
+	return 0;
+}
@@ -1,13 +1,20 @@
 #include "TerrainGrid.h"
+#include "SculptHistory.h"
 #include "core/Bonobo.h"
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 
 TerrainGrid::TerrainGrid(glm::ivec3 dimensions, float scale)
-	: dim(dimensions), grid(dimensions.x * dimensions.y * dimensions.z, false),
-	scale(scale), noise(PerlinNoise(0, 0.05f))
+	: dim(dimensions), scale(scale), dirtyMin(INT_MAX), dirtyMax(INT_MIN), voxelBrickCounts(0), precision(Precision::float32), brickCounts(0),
+	noise(PerlinNoise(0, 0.05f)), history(nullptr)
 {
+	resetVoxels();
 	regenerate(noise); // Generate the terrain immediately with the current noise function
 	updatedTerrain();
+	flushChanges(); // The density ranges are needed right away by the renderers
 }
 
 float TerrainGrid::get(glm::ivec3 p) const {
@@ -17,7 +24,16 @@ float TerrainGrid::get(glm::ivec3 p) const {
 		// If the position is out of bounds, return false
 		return 0;
 	}
-	return grid[getIndex(p)];
+	return getUnchecked(p);
+}
+
+float TerrainGrid::getUnchecked(glm::ivec3 p) const {
+	const VoxelBrick& brick = voxelBricks[getBrickIndex(p / BRICK_SIZE)];
+	if (brick.slot < 0) return brick.value;
+	glm::ivec3 local = p - p / BRICK_SIZE * BRICK_SIZE;
+	float value;
+	decodeVoxels(precision, getBrickVoxels(brick.slot) + getVoxelIndex(local) * getVoxelSize(), 1, &value);
+	return value;
 }
 
 void TerrainGrid::set(glm::ivec3 p, float newValue) {
@@ -33,12 +49,435 @@ void TerrainGrid::set(glm::ivec3 p, float newValue) {
 	if (newValue > 1) {
 		newValue = 1;
 	}
+	setUnchecked(p, newValue);
+}
+
+void TerrainGrid::setUnchecked(glm::ivec3 p, float newValue) {
+	newValue = quantize(newValue);
+
+	int brickIndex = getBrickIndex(p / BRICK_SIZE);
+	const VoxelBrick& brick = voxelBricks[brickIndex];
+	if (brick.slot < 0 && brick.value == newValue) return; // Nothing changes, so the brick can stay uniform
+
+	// The brick only becomes uniform again in compactBricks(), checking it on every set would be too slow
+	unsigned char* voxels = brick.slot < 0 ? allocateBrick(brickIndex) : getBrickVoxels(brick.slot);
+	glm::ivec3 local = p - p / BRICK_SIZE * BRICK_SIZE;
+	unsigned char* voxel = voxels + getVoxelIndex(local) * getVoxelSize();
+	unsigned char encoded[sizeof(float)];
+	encodeVoxels(precision, &newValue, 1, encoded);
+	if (std::memcmp(voxel, encoded, getVoxelSize()) == 0) return; // Only the voxels that really change are dirty
+	std::memcpy(voxel, encoded, getVoxelSize());
+	markDirty(p, p + glm::ivec3(1));
+}
+
+void TerrainGrid::getRow(glm::ivec3 start, int count, float* out) const {
+	if (start.y < 0 || start.y >= dim.y || start.z < 0 || start.z >= dim.z) {
+		// The entire row is out of bounds
+		std::fill(out, out + count, 0.0f);
+		return;
+	}
+
+	// Only the part of the row inside the grid is copied, the rest is filled with zeros
+	int begin = glm::clamp(-start.x, 0, count);
+	int end = glm::clamp(dim.x - start.x, begin, count);
+	std::fill(out, out + begin, 0.0f);
+
+	// One run per brick along the row
+	glm::ivec3 local(0, start.y % BRICK_SIZE, start.z % BRICK_SIZE);
+	int brickRow = getBrickIndex(glm::ivec3(0, start.y / BRICK_SIZE, start.z / BRICK_SIZE));
+	for (int i = begin; i < end;) {
+		int x = start.x + i;
+		int run = std::min(BRICK_SIZE - x % BRICK_SIZE, end - i);
+		const VoxelBrick& brick = voxelBricks[brickRow + x / BRICK_SIZE];
+		if (brick.slot < 0) {
+			std::fill(out + i, out + i + run, brick.value);
+		}
+		else {
+			local.x = x % BRICK_SIZE;
+			decodeRow(getBrickVoxels(brick.slot), local, run, out + i);
+		}
+		i += run;
+	}
+	std::fill(out + end, out + count, 0.0f);
+}
+
+void TerrainGrid::copyRegion(glm::ivec3 regionMin, glm::ivec3 regionMax, Snapshot& out) const {
+	out.min = regionMin;
+	out.size = glm::max(regionMax - regionMin, glm::ivec3(0));
+	out.dimensions = dim;
+	out.scale = scale;
+	out.values.resize(out.size.x * out.size.y * out.size.z);
+	for (int z = 0; z < out.size.z; z++) {
+		for (int y = 0; y < out.size.y; y++) {
+			getRow(regionMin + glm::ivec3(0, y, z), out.size.x, &out.values[(z * out.size.y + y) * out.size.x]);
+		}
+	}
+
+	// The ranges of the bricks with cubes in the region
+	out.brickMin = glm::clamp(regionMin / BRICK_SIZE, glm::ivec3(0), brickCounts);
+	glm::ivec3 brickMax = glm::clamp((regionMax + glm::ivec3(BRICK_SIZE - 1)) / BRICK_SIZE, out.brickMin, brickCounts);
+	out.brickCounts = brickMax - out.brickMin;
+	out.bricks.resize(out.brickCounts.x * out.brickCounts.y * out.brickCounts.z);
+	for (int z = 0; z < out.brickCounts.z; z++) {
+		for (int y = 0; y < out.brickCounts.y; y++) {
+			const DensityRange* row = &bricks[((out.brickMin.z + z) * brickCounts.y + out.brickMin.y + y) * brickCounts.x + out.brickMin.x];
+			std::copy(row, row + out.brickCounts.x, &out.bricks[(z * out.brickCounts.y + y) * out.brickCounts.x]);
+		}
+	}
+}
+
+void TerrainGrid::Snapshot::getRow(glm::ivec3 start, int count, float* out) const {
+	glm::ivec3 local = start - min;
+	if (local.y < 0 || local.y >= size.y || local.z < 0 || local.z >= size.z) {
+		std::fill(out, out + count, 0.0f);
+		return;
+	}
+
+	int begin = glm::clamp(-local.x, 0, count);
+	int end = glm::clamp(size.x - local.x, begin, count);
+	std::fill(out, out + begin, 0.0f);
+	if (begin < end) {
+		const float* row = values.data() + (local.z * size.y + local.y) * size.x + local.x + begin;
+		std::copy(row, row + (end - begin), out + begin);
+	}
+	std::fill(out + end, out + count, 0.0f);
+}
+
+float TerrainGrid::Snapshot::get(glm::ivec3 p) const {
+	glm::ivec3 local = p - min;
+	if (local.x < 0 || local.x >= size.x || local.y < 0 || local.y >= size.y || local.z < 0 || local.z >= size.z) {
+		return 0.0f;
+	}
+	return values[(local.z * size.y + local.y) * size.x + local.x];
+}
+
+void TerrainGrid::Snapshot::downsample(const Snapshot& source, int stride, glm::ivec3 regionMin, glm::ivec3 regionMax) {
+	min = regionMin;
+	size = glm::max(regionMax - regionMin, glm::ivec3(0));
+	// Enough voxels for coarser cubes covering every cube of the grid. The last ones are past the grid, so they sample the voxels on its far border instead.
+	dimensions = (source.dimensions + glm::ivec3(stride - 2)) / stride + glm::ivec3(1);
+	glm::ivec3 last = source.dimensions - glm::ivec3(1);
+	scale = source.scale * stride;
+	values.resize(size.x * size.y * size.z);
+	for (int z = 0; z < size.z; z++) {
+		for (int y = 0; y < size.y; y++) {
+			for (int x = 0; x < size.x; x++) {
+				glm::ivec3 p = min + glm::ivec3(x, y, z);
+				bool inside = p.x >= 0 && p.y >= 0 && p.z >= 0 && p.x < dimensions.x && p.y < dimensions.y && p.z < dimensions.z;
+				values[(z * size.y + y) * size.x + x] = inside ? source.get(glm::min(p * stride, last)) : 0.0f;
+			}
+		}
+	}
+
+	brickMin = glm::ivec3(0);
+	brickCounts = glm::ivec3(0);
+	bricks.clear();
+}
+
+// Combines the ranges of the bricks around the cubes [cubeMin, cubeMax), out of the bricks [first, first + counts).
+// Bricks outside of those are unknown, so they could cross any iso level.
+static TerrainGrid::DensityRange combineBricks(const std::vector<TerrainGrid::DensityRange>& bricks, glm::ivec3 first, glm::ivec3 counts,
+	glm::ivec3 cubeMin, glm::ivec3 cubeMax) {
+	TerrainGrid::DensityRange range;
+	if (cubeMin.x >= cubeMax.x || cubeMin.y >= cubeMax.y || cubeMin.z >= cubeMax.z) return range;
 
-	grid[getIndex(p)] = newValue;
+	glm::ivec3 brickMin = glm::max(cubeMin, glm::ivec3(0)) / TerrainGrid::BRICK_SIZE;
+	glm::ivec3 brickMax = (glm::max(cubeMax, glm::ivec3(1)) - glm::ivec3(1)) / TerrainGrid::BRICK_SIZE; // Inclusive
+	glm::ivec3 end = first + counts;
+	if (brickMin.x < first.x || brickMin.y < first.y || brickMin.z < first.z || brickMax.x >= end.x || brickMax.y >= end.y || brickMax.z >= end.z) {
+		range.min = -FLT_MAX;
+		range.max = FLT_MAX;
+		return range;
+	}
+
+	for (int z = brickMin.z; z <= brickMax.z; z++) {
+		for (int y = brickMin.y; y <= brickMax.y; y++) {
+			for (int x = brickMin.x; x <= brickMax.x; x++) {
+				glm::ivec3 local = glm::ivec3(x, y, z) - first;
+				const TerrainGrid::DensityRange& brick = bricks[(local.z * counts.y + local.y) * counts.x + local.x];
+				range.min = glm::min(range.min, brick.min);
+				range.max = glm::max(range.max, brick.max);
+			}
+		}
+	}
+	return range;
 }
 
-int TerrainGrid::getIndex(glm::ivec3 p) const {
-	return p.x + p.y * dim.x + p.z * dim.x * dim.y;
+TerrainGrid::DensityRange TerrainGrid::getRange(glm::ivec3 cubeMin, glm::ivec3 cubeMax) const {
+	return combineBricks(bricks, glm::ivec3(0), brickCounts, cubeMin, cubeMax);
+}
+
+TerrainGrid::DensityRange TerrainGrid::Snapshot::getRange(glm::ivec3 cubeMin, glm::ivec3 cubeMax) const {
+	return combineBricks(bricks, brickMin, brickCounts, cubeMin, cubeMax);
+}
+
+void TerrainGrid::updateBricks(glm::ivec3 regionMin, glm::ivec3 regionMax) {
+	glm::ivec3 cubeCounts = glm::max(dim - glm::ivec3(1), glm::ivec3(0));
+	glm::ivec3 counts = (cubeCounts + glm::ivec3(BRICK_SIZE - 1)) / BRICK_SIZE;
+	if (counts != brickCounts) {
+		// The grid was resized, so every brick has to be recomputed
+		brickCounts = counts;
+		bricks.assign(brickCounts.x * brickCounts.y * brickCounts.z, DensityRange());
+		regionMin = glm::ivec3(0);
+		regionMax = dim;
+	}
+	if (bricks.empty() || regionMin.x >= regionMax.x || regionMin.y >= regionMax.y || regionMin.z >= regionMax.z) return;
+
+	// A voxel on the border of two bricks is a corner of the cubes of both
+	glm::ivec3 first = glm::max(regionMin - glm::ivec3(1), glm::ivec3(0)) / BRICK_SIZE;
+	glm::ivec3 last = glm::min((regionMax - glm::ivec3(1)) / BRICK_SIZE, brickCounts - glm::ivec3(1));
+	for (int bz = first.z; bz <= last.z; bz++) {
+		for (int by = first.y; by <= last.y; by++) {
+			for (int bx = first.x; bx <= last.x; bx++) {
+				glm::ivec3 voxelMin = glm::ivec3(bx, by, bz) * BRICK_SIZE;
+				glm::ivec3 voxelMax = glm::min(voxelMin + glm::ivec3(BRICK_SIZE + 1), dim);
+
+				// The voxels of the cubes reach one voxel into the next voxel bricks along each axis
+				DensityRange range;
+				glm::ivec3 lastVoxelBrick = (voxelMax - glm::ivec3(1)) / BRICK_SIZE;
+				for (int vz = bz; vz <= lastVoxelBrick.z; vz++) {
+					for (int vy = by; vy <= lastVoxelBrick.y; vy++) {
+						for (int vx = bx; vx <= lastVoxelBrick.x; vx++) {
+							const VoxelBrick& brick = voxelBricks[getBrickIndex(glm::ivec3(vx, vy, vz))];
+							if (brick.slot < 0) {
+								range.min = glm::min(range.min, brick.value);
+								range.max = glm::max(range.max, brick.value);
+								continue;
+							}
+
+							const unsigned char* voxels = getBrickVoxels(brick.slot);
+							glm::ivec3 localMin = glm::max(voxelMin - glm::ivec3(vx, vy, vz) * BRICK_SIZE, glm::ivec3(0));
+							glm::ivec3 localMax = glm::min(voxelMax - glm::ivec3(vx, vy, vz) * BRICK_SIZE, glm::ivec3(BRICK_SIZE));
+							float row[BRICK_SIZE];
+							for (int z = localMin.z; z < localMax.z; z++) {
+								for (int y = localMin.y; y < localMax.y; y++) {
+									decodeRow(voxels, glm::ivec3(localMin.x, y, z), localMax.x - localMin.x, row);
+									for (int x = 0; x < localMax.x - localMin.x; x++) {
+										range.min = glm::min(range.min, row[x]);
+										range.max = glm::max(range.max, row[x]);
+									}
+								}
+							}
+						}
+					}
+				}
+				bricks[(bz * brickCounts.y + by) * brickCounts.x + bx] = range;
+			}
+		}
+	}
+}
+
+void TerrainGrid::resetVoxels() {
+	voxelBrickCounts = (glm::max(dim, glm::ivec3(0)) + glm::ivec3(BRICK_SIZE - 1)) / BRICK_SIZE;
+	VoxelBrick air = { -1, 0.0f };
+	voxelBricks.assign(voxelBrickCounts.x * voxelBrickCounts.y * voxelBrickCounts.z, air);
+	poolPages.clear();
+	freeSlots.clear();
+	if (history) history->clear(); // The strokes only fit the voxels they were sculpted into
+}
+
+int TerrainGrid::getBrickIndex(glm::ivec3 brick) const {
+	return (brick.z * voxelBrickCounts.y + brick.y) * voxelBrickCounts.x + brick.x;
+}
+
+unsigned char* TerrainGrid::getBrickVoxels(int slot) {
+	return poolPages[slot / POOL_PAGE_BRICKS].get() + (slot % POOL_PAGE_BRICKS) * BRICK_VOXELS * getVoxelSize();
+}
+
+const unsigned char* TerrainGrid::getBrickVoxels(int slot) const {
+	return poolPages[slot / POOL_PAGE_BRICKS].get() + (slot % POOL_PAGE_BRICKS) * BRICK_VOXELS * getVoxelSize();
+}
+
+unsigned char* TerrainGrid::allocateBrick(int brickIndex) {
+	VoxelBrick& brick = voxelBricks[brickIndex];
+	if (brick.slot >= 0) return getBrickVoxels(brick.slot);
+
+	if (freeSlots.empty()) {
+		// Add a page, and hand out its slots from the front
+		int firstSlot = static_cast<int>(poolPages.size()) * POOL_PAGE_BRICKS;
+		poolPages.emplace_back(new unsigned char[POOL_PAGE_BRICKS * BRICK_VOXELS * getVoxelSize()]);
+		for (int slot = firstSlot + POOL_PAGE_BRICKS - 1; slot >= firstSlot; slot--) {
+			freeSlots.push_back(slot);
+		}
+	}
+	brick.slot = freeSlots.back();
+	freeSlots.pop_back();
+
+	// Fill the voxels with copies of the first one
+	unsigned char* voxels = getBrickVoxels(brick.slot);
+	size_t voxelSize = getVoxelSize();
+	encodeVoxels(precision, &brick.value, 1, voxels);
+	for (int i = 1; i < BRICK_VOXELS; i++) {
+		std::memcpy(voxels + i * voxelSize, voxels, voxelSize);
+	}
+	return voxels;
+}
+
+void TerrainGrid::freeBrick(int brickIndex, float value) {
+	VoxelBrick& brick = voxelBricks[brickIndex];
+	if (brick.slot >= 0) {
+		freeSlots.push_back(brick.slot);
+	}
+	brick.slot = -1;
+	brick.value = value;
+}
+
+int TerrainGrid::getVoxelIndex(glm::ivec3 local) {
+	return Layout::index<BRICK_SIZE>(local.x, local.y, local.z);
+}
+
+void TerrainGrid::decodeRow(const unsigned char* voxels, glm::ivec3 local, int count, float* out) const {
+	size_t voxelSize = getVoxelSize();
+	if (Layout::ROWS_CONTIGUOUS) {
+		decodeVoxels(precision, voxels + getVoxelIndex(local) * voxelSize, count, out);
+		return;
+	}
+	for (int x = 0; x < count; x++) {
+		decodeVoxels(precision, voxels + getVoxelIndex(local + glm::ivec3(x, 0, 0)) * voxelSize, 1, out + x);
+	}
+}
+
+bool TerrainGrid::isUniform(glm::ivec3 brick, const unsigned char* voxels) const {
+	// Compare whole rows against a row of copies of the first voxel, which is the first in every layout
+	size_t voxelSize = getVoxelSize();
+	unsigned char firstRow[BRICK_SIZE * sizeof(float)];
+	for (int x = 0; x < BRICK_SIZE; x++) {
+		std::memcpy(firstRow + x * voxelSize, voxels, voxelSize);
+	}
+	glm::ivec3 localMax = glm::min(dim - brick * BRICK_SIZE, glm::ivec3(BRICK_SIZE));
+	for (int z = 0; z < localMax.z; z++) {
+		for (int y = 0; y < localMax.y; y++) {
+			if (Layout::ROWS_CONTIGUOUS) {
+				if (std::memcmp(voxels + getVoxelIndex(glm::ivec3(0, y, z)) * voxelSize, firstRow, localMax.x * voxelSize) != 0) return false;
+				continue;
+			}
+			for (int x = 0; x < localMax.x; x++) {
+				if (std::memcmp(voxels + getVoxelIndex(glm::ivec3(x, y, z)) * voxelSize, firstRow, voxelSize) != 0) return false;
+			}
+		}
+	}
+	return true;
+}
+
+void TerrainGrid::storeBrick(glm::ivec3 brick, const float* voxels) {
+	unsigned char encoded[BRICK_VOXELS * sizeof(float)];
+	encodeVoxels(precision, voxels, BRICK_VOXELS, encoded);
+
+	int brickIndex = getBrickIndex(brick);
+	if (isUniform(brick, encoded)) {
+		float value;
+		decodeVoxels(precision, encoded, 1, &value);
+		freeBrick(brickIndex, value);
+	}
+	else {
+		std::memcpy(allocateBrick(brickIndex), encoded, BRICK_VOXELS * getVoxelSize());
+	}
+}
+
+void TerrainGrid::compactBricks(glm::ivec3 regionMin, glm::ivec3 regionMax) {
+	if (regionMin.x >= regionMax.x || regionMin.y >= regionMax.y || regionMin.z >= regionMax.z) return;
+
+	glm::ivec3 first = glm::max(regionMin, glm::ivec3(0)) / BRICK_SIZE;
+	glm::ivec3 last = glm::min((regionMax - glm::ivec3(1)) / BRICK_SIZE, voxelBrickCounts - glm::ivec3(1));
+	for (int bz = first.z; bz <= last.z; bz++) {
+		for (int by = first.y; by <= last.y; by++) {
+			for (int bx = first.x; bx <= last.x; bx++) {
+				int brickIndex = getBrickIndex(glm::ivec3(bx, by, bz));
+				int slot = voxelBricks[brickIndex].slot;
+				if (slot >= 0 && isUniform(glm::ivec3(bx, by, bz), getBrickVoxels(slot))) {
+					float value;
+					decodeVoxels(precision, getBrickVoxels(slot), 1, &value);
+					freeBrick(brickIndex, value);
+				}
+			}
+		}
+	}
+}
+
+size_t TerrainGrid::getVoxelSize(Precision precision) {
+	switch (precision) {
+	case Precision::unorm16: return sizeof(uint16_t);
+	case Precision::unorm8: return sizeof(uint8_t);
+	default: return sizeof(float);
+	}
+}
+
+size_t TerrainGrid::getVoxelSize() const {
+	return getVoxelSize(precision);
+}
+
+float TerrainGrid::quantize(float value) const {
+	float stored;
+	unsigned char encoded[sizeof(float)];
+	encodeVoxels(precision, &value, 1, encoded);
+	decodeVoxels(precision, encoded, 1, &stored);
+	return stored;
+}
+
+void TerrainGrid::decodeVoxels(Precision precision, const unsigned char* voxels, int count, float* out) {
+	if (precision == Precision::float32) {
+		std::memcpy(out, voxels, count * sizeof(float));
+	}
+	else if (precision == Precision::unorm16) {
+		for (int i = 0; i < count; i++) {
+			uint16_t value;
+			std::memcpy(&value, voxels + i * sizeof(uint16_t), sizeof(uint16_t));
+			out[i] = value * (1.0f / 65535.0f);
+		}
+	}
+	else {
+		for (int i = 0; i < count; i++) {
+			out[i] = voxels[i] * (1.0f / 255.0f);
+		}
+	}
+}
+
+void TerrainGrid::encodeVoxels(Precision precision, const float* values, int count, unsigned char* out) {
+	if (precision == Precision::float32) {
+		std::memcpy(out, values, count * sizeof(float));
+	}
+	else if (precision == Precision::unorm16) {
+		for (int i = 0; i < count; i++) {
+			uint16_t value = static_cast<uint16_t>(glm::clamp(values[i], 0.0f, 1.0f) * 65535.0f + 0.5f);
+			std::memcpy(out + i * sizeof(uint16_t), &value, sizeof(uint16_t));
+		}
+	}
+	else {
+		for (int i = 0; i < count; i++) {
+			out[i] = static_cast<uint8_t>(glm::clamp(values[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+		}
+	}
+}
+
+void TerrainGrid::setPrecision(Precision newPrecision) {
+	if (precision == newPrecision) return;
+	if (history) history->clear(); // The strokes are differences between voxels of the old precision
+
+	// Convert the bricks with voxels of their own through floats, into pages of the new size. The slots stay the same.
+	std::vector<std::unique_ptr<unsigned char[]>> oldPages;
+	oldPages.swap(poolPages);
+	for (size_t page = 0; page < oldPages.size(); page++) {
+		poolPages.emplace_back(new unsigned char[POOL_PAGE_BRICKS * BRICK_VOXELS * getVoxelSize(newPrecision)]);
+	}
+	float values[BRICK_VOXELS];
+	for (VoxelBrick& brick : voxelBricks) {
+		if (brick.slot < 0) continue;
+		size_t offset = (brick.slot % POOL_PAGE_BRICKS) * BRICK_VOXELS;
+		decodeVoxels(precision, oldPages[brick.slot / POOL_PAGE_BRICKS].get() + offset * getVoxelSize(), BRICK_VOXELS, values);
+		encodeVoxels(newPrecision, values, BRICK_VOXELS, poolPages[brick.slot / POOL_PAGE_BRICKS].get() + offset * getVoxelSize(newPrecision));
+	}
+	oldPages.clear();
+	precision = newPrecision;
+	for (VoxelBrick& brick : voxelBricks) {
+		if (brick.slot < 0) brick.value = quantize(brick.value);
+	}
+
+	// Rounding changes the densities a little, and can make some bricks uniform
+	updatedTerrain();
+}
+
+TerrainGrid::Precision TerrainGrid::getPrecision() const {
+	return precision;
 }
 
 glm::ivec3 TerrainGrid::getDimensions() const {
@@ -53,6 +492,55 @@ int TerrainGrid::getTotalSize() const {
 	return dim.x * dim.y * dim.z;
 }
 
+size_t TerrainGrid::getAllocatedBrickCount() const {
+	return poolPages.size() * POOL_PAGE_BRICKS - freeSlots.size();
+}
+
+size_t TerrainGrid::getMemoryUsage() const {
+	return voxelBricks.size() * sizeof(VoxelBrick) + poolPages.size() * POOL_PAGE_BRICKS * BRICK_VOXELS * getVoxelSize()
+		+ freeSlots.capacity() * sizeof(int) + bricks.size() * sizeof(DensityRange);
+}
+
+const char* TerrainGrid::getLayoutName() {
+	return Layout::getName();
+}
+
+void TerrainGrid::copyBrick(glm::ivec3 brick, float* out) const {
+	const VoxelBrick& stored = voxelBricks[getBrickIndex(brick)];
+	if (stored.slot < 0) {
+		std::fill(out, out + BRICK_VOXELS, stored.value);
+	}
+	else {
+		decodeVoxels(precision, getBrickVoxels(stored.slot), BRICK_VOXELS, out);
+	}
+
+	// Only the bricks on the far borders of the grid have voxels outside of it
+	glm::ivec3 localMax = glm::min(dim - brick * BRICK_SIZE, glm::ivec3(BRICK_SIZE));
+	if (localMax == glm::ivec3(BRICK_SIZE)) return;
+	for (int z = 0; z < BRICK_SIZE; z++) {
+		for (int y = 0; y < BRICK_SIZE; y++) {
+			for (int x = 0; x < BRICK_SIZE; x++) {
+				if (x >= localMax.x || y >= localMax.y || z >= localMax.z) {
+					out[getVoxelIndex(glm::ivec3(x, y, z))] = 0.0f;
+				}
+			}
+		}
+	}
+}
+
+void TerrainGrid::replaceBrick(glm::ivec3 brick, const float* voxels) {
+	storeBrick(brick, voxels);
+	markDirty(brick * BRICK_SIZE, glm::min((brick + glm::ivec3(1)) * BRICK_SIZE, dim));
+}
+
+glm::ivec3 TerrainGrid::getVoxelBrickCounts() const {
+	return voxelBrickCounts;
+}
+
+void TerrainGrid::setHistory(SculptHistory* history) {
+	this->history = history;
+}
+
 void TerrainGrid::setScale(float newScale) {
 	if (scale == newScale) return;
 	scale = newScale;
@@ -66,12 +554,10 @@ PerlinNoise TerrainGrid::getNoise() const {
 }
 
 void TerrainGrid::clear() {
-	for (int i = 0; i < grid.size(); i++) {
-		grid[i] = false;
-	}
+	resetVoxels();
 	for (int x = 0; x < dim.x; x++) {
 		for (int z = 0; z < dim.z; z++) {
-			grid[x + z * dim.x * dim.y] = true;
+			set(glm::ivec3(x, 0, z), true);
 		}
 	}
 	updatedTerrain();
@@ -83,35 +569,57 @@ void TerrainGrid::sculpt(glm::ivec3 center, FPSCameraf* camera, float size, floa
 	float centerDepth = glm::length(glm::vec3(center) - camera->mWorld.GetTranslation());
 	float offset = 0.4f; // Small offset to allow sculpting a bit behind the terrain
 
-	for (int x = center.x - size; x <= center.x + size; x++) {
-		for (int y = center.y - size; y <= center.y + size; y++) {
-			for (int z = center.z - size; z <= center.z + size; z++) {
+	// Only the part of the brush inside of the grid, so the voxels don't have to be bounds checked one by one
+	glm::ivec3 first = glm::max(glm::ivec3(int(center.x - size), int(center.y - size), int(center.z - size)), glm::ivec3(0));
+	glm::ivec3 last = glm::min(glm::ivec3(int(center.x + size), int(center.y + size), int(center.z + size)), dim - glm::ivec3(1));
+	if (history) history->recordBricks(first, last + glm::ivec3(1));
+	for (int x = first.x; x <= last.x; x++) {
+		for (int y = first.y; y <= last.y; y++) {
+			for (int z = first.z; z <= last.z; z++) {
 				if (glm::pow(x - center.x, 2) + glm::pow(y - center.y, 2) + glm::pow(z - center.z, 2) <= radiusSquared) {
 					float depth = glm::length(glm::vec3(x, y, z) - camera->mWorld.GetTranslation());
 
 					if (destructive && depth < centerDepth + offset) { // Only modify voxels that are closer to the camera than the target we hit
-						set(glm::ivec3(x, y, z), get(glm::ivec3(x, y, z)) - strength);
+						setUnchecked(glm::ivec3(x, y, z), glm::clamp(getUnchecked(glm::ivec3(x, y, z)) - strength, 0.0f, 1.0f));
 					}
 					else if (!destructive) { // Only modify voxels that are further to the camera than the target we hit
-						set(glm::ivec3(x, y, z), get(glm::ivec3(x, y, z)) + strength);
+						setUnchecked(glm::ivec3(x, y, z), glm::clamp(getUnchecked(glm::ivec3(x, y, z)) + strength, 0.0f, 1.0f));
 					}
 				}
 			}
 		}
 	}
 
-	// Regenerate the VBO, since the grid changed
-	updatedTerrain();
+	// The VBO is regenerated with the next flush. Only the voxels set() changed are dirty, which is at most the brush.
 }
 
-void TerrainGrid::registerUpdateCallback(std::function<void()> callback) {
+void TerrainGrid::registerUpdateCallback(std::function<void(glm::ivec3, glm::ivec3)> callback) {
 	updateCallbacks.push_back(callback);
 }
 
 void TerrainGrid::updatedTerrain() {
+	markDirty(glm::ivec3(0), dim);
+}
+
+void TerrainGrid::markDirty(glm::ivec3 regionMin, glm::ivec3 regionMax) {
+	dirtyMin = glm::min(dirtyMin, regionMin);
+	dirtyMax = glm::max(dirtyMax, regionMax);
+}
+
+void TerrainGrid::flushChanges() {
+	// Voxels outside of the grid can't change, e.g. the ones that were dirty before the grid got smaller
+	glm::ivec3 regionMin = glm::clamp(dirtyMin, glm::ivec3(0), dim);
+	glm::ivec3 regionMax = glm::clamp(dirtyMax, glm::ivec3(0), dim);
+	dirtyMin = glm::ivec3(INT_MAX);
+	dirtyMax = glm::ivec3(INT_MIN);
+	if (regionMin.x >= regionMax.x || regionMin.y >= regionMax.y || regionMin.z >= regionMax.z) return; // Nothing changed
+
+	compactBricks(regionMin, regionMax);
+	updateBricks(regionMin, regionMax);
+
 	// Call back the callbacks
 	for (auto& callback : updateCallbacks) {
-		callback();
+		callback(regionMin, regionMax);
 	}
 }
 
@@ -120,23 +628,34 @@ void TerrainGrid::regenerate(PerlinNoise newNoise) {
 	LogInfo("Regenerating the terrain with perlin noise");
 	noise = newNoise; // Save the noise function in case we need to generate more later (if the grid is resized)
 
-	for (int x = 0; x < dim.x; x++) {
-		for (int z = 0; z < dim.z; z++) {
-			float noise_height = noise.sampleNoise(x, z); // Sample the height between 0-1 at this position
-			noise_height = floor(noise_height * dim.y); // Scale it by our max Y height and floor this
-			// Set the voxels to true as long as they are below or equal to this noise height
-			for (int y = 0; y < dim.y; y++) {
-				if (y <= noise_height) {
-					if (y >= noise_height - 1) {
-						set(glm::vec3(x, y, z), noise_height - y);
-					}
-					else {
-						set(glm::vec3(x, y, z), 1);
-					}
+	// Generate a column of bricks at a time, so that the solid and air bricks never need voxels of their own
+	resetVoxels();
+	float heights[BRICK_SIZE][BRICK_SIZE];
+	float voxels[BRICK_VOXELS];
+	for (int bz = 0; bz < voxelBrickCounts.z; bz++) {
+		for (int bx = 0; bx < voxelBrickCounts.x; bx++) {
+			for (int z = 0; z < BRICK_SIZE; z++) {
+				for (int x = 0; x < BRICK_SIZE; x++) {
+					float noise_height = noise.sampleNoise(bx * BRICK_SIZE + x, bz * BRICK_SIZE + z); // Sample the height between 0-1 at this position
+					heights[z][x] = floor(noise_height * dim.y); // Scale it by our max Y height and floor this
 				}
-				else {
-					set(glm::vec3(x, y, z), 0);
+			}
+			for (int by = 0; by < voxelBrickCounts.y; by++) {
+				for (int z = 0; z < BRICK_SIZE; z++) {
+					for (int y = 0; y < BRICK_SIZE; y++) {
+						for (int x = 0; x < BRICK_SIZE; x++) {
+							// The voxels are solid as long as they are below or equal to the noise height
+							float noise_height = heights[z][x];
+							float height = static_cast<float>(by * BRICK_SIZE + y);
+							float value = 0.0f;
+							if (height <= noise_height) {
+								value = height >= noise_height - 1 ? noise_height - height : 1.0f;
+							}
+							voxels[getVoxelIndex(glm::ivec3(x, y, z))] = glm::clamp(value, 0.0f, 1.0f);
+						}
+					}
 				}
+				storeBrick(glm::ivec3(bx, by, bz), voxels);
 			}
 		}
 	}
@@ -146,20 +665,50 @@ void TerrainGrid::regenerate(PerlinNoise newNoise) {
 }
 
 void TerrainGrid::resize(glm::ivec3 newDimensions) {
-	std::vector<float> original = grid; // Copy the current grid
-
+	// Keep the current voxels around
 	glm::ivec3 oldDim = dim; // Save the old dimensions
+	glm::ivec3 oldBrickCounts = voxelBrickCounts;
+	std::vector<VoxelBrick> oldBricks;
+	std::vector<std::unique_ptr<unsigned char[]>> oldPages;
+	oldBricks.swap(voxelBricks);
+	oldPages.swap(poolPages);
+
 	dim = newDimensions; // Set the dimensions
-	grid = std::vector<float>(dim.x * dim.y * dim.z, false); // Actually create a grid the right size
 	regenerate(noise); // Use the regenerate to generate an entire grid based on the current noise pattern
 
 	// If Y changed, we can't keep the edited map since we would have to stretch/squash it along the y-axis
 	if (oldDim.y != dim.y) return;
-	// Add as much of the original grid back as possible
-	for (int x = 0; x < glm::min(dim.x, oldDim.x); x++) {
-		for (int y = 0; y < glm::min(dim.y, oldDim.y); y++) {
-			for (int z = 0; z < glm::min(dim.z, oldDim.z); z++) {
-				grid[getIndex(glm::vec3(x, y, z))] = original[x + y * oldDim.x + z * oldDim.x * oldDim.y];
+	// Add as much of the original grid back as possible. Both grids start at 0, so their bricks line up.
+	glm::ivec3 kept = glm::min(dim, oldDim);
+	glm::ivec3 keptBricks = (kept + glm::ivec3(BRICK_SIZE - 1)) / BRICK_SIZE;
+	float voxels[BRICK_VOXELS];
+	for (int bz = 0; bz < keptBricks.z; bz++) {
+		for (int by = 0; by < keptBricks.y; by++) {
+			for (int bx = 0; bx < keptBricks.x; bx++) {
+				glm::ivec3 brick(bx, by, bz);
+				const VoxelBrick& old = oldBricks[(bz * oldBrickCounts.y + by) * oldBrickCounts.x + bx];
+				float oldVoxels[BRICK_VOXELS];
+				if (old.slot >= 0) {
+					decodeVoxels(precision, oldPages[old.slot / POOL_PAGE_BRICKS].get() + (old.slot % POOL_PAGE_BRICKS) * BRICK_VOXELS * getVoxelSize(), BRICK_VOXELS, oldVoxels);
+				}
+
+				// Take the old voxels where they were in the grid before, and the regenerated ones everywhere else
+				glm::ivec3 voxelMin = brick * BRICK_SIZE;
+				glm::ivec3 oldMax = kept - voxelMin;
+				for (int z = 0; z < BRICK_SIZE; z++) {
+					for (int y = 0; y < BRICK_SIZE; y++) {
+						for (int x = 0; x < BRICK_SIZE; x++) {
+							int i = getVoxelIndex(glm::ivec3(x, y, z));
+							if (x < oldMax.x && y < oldMax.y && z < oldMax.z) {
+								voxels[i] = old.slot >= 0 ? oldVoxels[i] : old.value;
+							}
+							else {
+								voxels[i] = get(voxelMin + glm::ivec3(x, y, z));
+							}
+						}
+					}
+				}
+				storeBrick(brick, voxels);
 			}
 		}
 	}
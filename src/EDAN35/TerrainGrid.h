@@ -1,28 +1,93 @@
 #pragma once
 
 #include "PerlinNoise.h"
+#include "VoxelLayout.h"
 #include <vector>
 #include <glm/vec3.hpp>
 #include <glad/glad.h>
 #include "core/FPSCamera.h"
 #include <functional>
+#include <memory>
+#include <cfloat>
+
+class SculptHistory;
 
 // The Terrain grid represents the terrain as a 3d grid of booleans (basically voxels)
 // indicating if they are inside or outside of the terrain
+//
+// The voxels are stored sparsely, in bricks of BRICK_SIZE^3 voxels. Almost all of the grid is solid ground or air,
+// so a brick whose voxels all have the same value is stored as just that value, and only the others get voxels of their own from a pool.
+// The order of the voxels inside of the bricks is the VoxelLayout TERRAIN_VOXEL_LAYOUT, picked at compile time.
 class TerrainGrid {
 public:
+	static const int BRICK_SIZE = 8; // The amount of cubes along each axis of the bricks the density ranges are kept for
+	static const int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+	// The lowest and highest density of some voxels
+	struct DensityRange {
+		float min = FLT_MAX; // An empty range, which never crosses
+		float max = -FLT_MAX;
+
+		// Whether a surface at the iso level can pass through the voxels, i.e. some of them are inside of the terrain (below it) and some are not
+		bool crosses(float isoLevel) const { return min < isoLevel && max >= isoLevel; }
+	};
+
+	// A copy of the voxels [min, min + size) of a grid, which can be read on another thread while the grid itself keeps changing
+	struct Snapshot {
+		glm::ivec3 min;
+		glm::ivec3 size;
+		glm::ivec3 dimensions; // The dimensions of the whole grid
+		float scale;
+		std::vector<float> values;
+		glm::ivec3 brickMin; // The first brick of bricks
+		glm::ivec3 brickCounts;
+		std::vector<DensityRange> bricks; // The ranges of the bricks around the copied voxels
+
+		// Same as TerrainGrid::getRow(). Voxels outside of the copied region read as 0, just like the ones outside of the grid.
+		void getRow(glm::ivec3 start, int count, float* out) const;
+		// Same as TerrainGrid::getRange(). Bricks outside of the copied region are assumed to cross any iso level.
+		DensityRange getRange(glm::ivec3 cubeMin, glm::ivec3 cubeMax) const;
+		// Same as TerrainGrid::get(), voxels outside of the copied region read as 0
+		float get(glm::ivec3 p) const;
+		// Makes this the voxels [regionMin, regionMax) of a coarser grid, made of every stride-th voxel of source along each axis.
+		// Its cubes cover all of the grid, the voxels past the far border of the grid are the ones on the border.
+		// The coarser grid has no brick ranges, so all of its bricks are assumed to cross.
+		void downsample(const Snapshot& source, int stride, glm::ivec3 regionMin, glm::ivec3 regionMax);
+	};
+
+	// How the voxels of the bricks with voxels of their own are stored. The densities are always in [0, 1], so they can be stored as fixed point.
+	enum class Precision : unsigned int {
+		float32, // 4 bytes per voxel, exact
+		unorm16, // 2 bytes per voxel, rounded to steps of 1/65535
+		unorm8 // 1 byte per voxel, rounded to steps of 1/255
+	};
+
 	TerrainGrid() = delete; // No default constructor, we require dimensions to be provided
 	TerrainGrid(glm::ivec3 dimensions, float scale);
 
 	float get(glm::ivec3) const; // Gets the boolean value at X, Y, Z in the grid
 	void set(glm::ivec3, float newValue); // Sets the boolean value at X, Y, Z in the grid
+	// Same as get() and set() without the bounds checks, for loops that already know that p is inside of the grid. The new value must be in [0, 1].
+	float getUnchecked(glm::ivec3 p) const;
+	void setUnchecked(glm::ivec3 p, float newValue);
+	// Copies the values of count voxels starting at start along +x into out. Out of bounds voxels read as 0, just like get().
+	void getRow(glm::ivec3 start, int count, float* out) const;
+	// Copies the voxels [regionMin, regionMax) into out, reusing its memory
+	void copyRegion(glm::ivec3 regionMin, glm::ivec3 regionMax, Snapshot& out) const;
+	// The range of the densities at the corners of the cubes [cubeMin, cubeMax), from the ranges of the bricks around them.
+	// It can be wider than the actual range, but never narrower, so cubes whose range doesn't cross the iso level can be skipped.
+	DensityRange getRange(glm::ivec3 cubeMin, glm::ivec3 cubeMax) const;
 
 	void resize(glm::ivec3 newDimensions); // Resizes the grid to new dimensions, while keeping as much of the current contents as possible
 	void regenerate(PerlinNoise newNoise); // Regenerate the grid with new Perlin noise terrain
 	void clear(); // Clears the grid to air, except for the bottom layer which is solid ground
 	void sculpt(glm::ivec3 center, FPSCameraf* camera, float size, float strength, bool destructive);
 
-	void registerUpdateCallback(std::function<void()> callback); // Registers a callback to be called whenever the grid is updated
+	// Registers a callback to be called whenever the grid is updated, with the voxels [regionMin, regionMax) that changed
+	void registerUpdateCallback(std::function<void(glm::ivec3 regionMin, glm::ivec3 regionMax)> callback);
+	// Changes are queued, and only reach the callbacks and the density ranges here. Called once per frame, so that all of the edits of a frame
+	// are handled at once, with the box around all of them.
+	void flushChanges();
 
 	glm::ivec3 getDimensions() const; // Gets all dimensions as a vec
 	int getTotalSize() const; // total amount of voxels = max_x * max_y * max_z
@@ -33,15 +98,76 @@ public:
 
 	PerlinNoise getNoise() const;
 
+	// Converts the stored voxels to a precision. set() rounds every value to the precision, so get() returns exactly what is stored.
+	void setPrecision(Precision precision);
+	Precision getPrecision() const;
+
+	size_t getAllocatedBrickCount() const; // The amount of bricks with voxels of their own
+	size_t getMemoryUsage() const; // The bytes used by the voxels and the density ranges
+
+	static const char* getLayoutName(); // The name of the layout the voxels of the bricks are stored in
+
+	// The voxels [BRICK_SIZE * brick, BRICK_SIZE * (brick + 1)), as BRICK_VOXELS values in the layout of the grid. Used to record and restore the sculpting history.
+	// The voxels outside of the grid read as 0, just like get(), as compactBricks() can change them at any time.
+	void copyBrick(glm::ivec3 brick, float* out) const;
+	void replaceBrick(glm::ivec3 brick, const float* voxels); // Replaces the voxels of a brick with ones from copyBrick()
+	glm::ivec3 getVoxelBrickCounts() const; // The amount of bricks of voxels along each axis
+	// The history sculpt() records the bricks it changes in, or nullptr. The history is cleared whenever the grid is regenerated, resized, cleared or converted.
+	void setHistory(SculptHistory* history);
+
 private:
-	void updatedTerrain();
-	int getIndex(glm::ivec3 p) const;
+	void updatedTerrain(); // Queues a notification that the entire grid changed
+	void markDirty(glm::ivec3 regionMin, glm::ivec3 regionMax); // Adds the voxels [regionMin, regionMax) to the ones the callbacks are notified about next
+	void updateBricks(glm::ivec3 regionMin, glm::ivec3 regionMax); // Recomputes the ranges of the bricks that contain any of the voxels [regionMin, regionMax)
+
+	typedef TERRAIN_VOXEL_LAYOUT Layout;
+	static const int POOL_PAGE_BRICKS = 256; // The pool grows a page of bricks at a time, so that it never has to move the bricks it already has
+
+	// The voxels [BRICK_SIZE * brick, BRICK_SIZE * (brick + 1)) of the grid
+	struct VoxelBrick {
+		int slot; // Where the voxels are in the pool, or -1 when they all have the same value
+		float value; // The value of every voxel when there is no slot
+	};
+
+	void resetVoxels(); // Makes the grid all air, and releases the pool
+	int getBrickIndex(glm::ivec3 brick) const;
+	static int getVoxelIndex(glm::ivec3 local); // Where the voxel local of a brick is among its voxels
+	unsigned char* getBrickVoxels(int slot); // The voxels of a slot of the pool in the grid's precision and layout
+	const unsigned char* getBrickVoxels(int slot) const;
+	unsigned char* allocateBrick(int brickIndex); // Gives a brick voxels of its own if it has none yet, filled with its value
+	void freeBrick(int brickIndex, float value); // Makes every voxel of the brick value, and gives its slot back to the pool
+	// Decodes count voxels along +x of a brick starting at local, which are only next to each other in some layouts
+	void decodeRow(const unsigned char* voxels, glm::ivec3 local, int count, float* out) const;
+	bool isUniform(glm::ivec3 brick, const unsigned char* voxels) const; // Whether all of the brick's voxels inside the grid have the same value
+	// Stores a whole brick, given in the grid's layout. Only the voxels inside the grid matter, so the brick can stay uniform on the border of the grid.
+	void storeBrick(glm::ivec3 brick, const float* voxels);
+	// Frees the bricks of the voxels [regionMin, regionMax) whose voxels all ended up with the same value
+	void compactBricks(glm::ivec3 regionMin, glm::ivec3 regionMax);
+
+	static size_t getVoxelSize(Precision precision); // The bytes per stored voxel
+	size_t getVoxelSize() const;
+	float quantize(float value) const; // The closest value to value the precision can store
+	static void decodeVoxels(Precision precision, const unsigned char* voxels, int count, float* out);
+	static void encodeVoxels(Precision precision, const float* values, int count, unsigned char* out);
 
-	std::vector<std::function<void()>> updateCallbacks;
+	std::vector<std::function<void(glm::ivec3, glm::ivec3)>> updateCallbacks;
 
 	glm::ivec3 dim; // The dimensions of the terrain grid
 	float scale;
-	std::vector<float> grid; // The actual underlying terrain data
+	// The box around the voxels [dirtyMin, dirtyMax) that changed since the last flushChanges(). Empty when no voxel changed.
+	glm::ivec3 dirtyMin;
+	glm::ivec3 dirtyMax;
+	// The actual underlying terrain data
+	glm::ivec3 voxelBrickCounts; // The amount of voxel bricks along each axis
+	std::vector<VoxelBrick> voxelBricks;
+	Precision precision;
+	std::vector<std::unique_ptr<unsigned char[]>> poolPages; // POOL_PAGE_BRICKS bricks of voxels each
+	std::vector<int> freeSlots; // The slots of the pool no brick uses
+	// The density range of every brick of BRICK_SIZE^3 cubes, including the corners they share with the next bricks.
+	// They are kept up to date for every change the callbacks are notified about.
+	glm::ivec3 brickCounts;
+	std::vector<DensityRange> bricks;
 
 	PerlinNoise noise; // The PerlinNoise that should be used to generate more terrain
+	SculptHistory* history;
 };
@@ -1,37 +1,642 @@
 #include "TerrainMesh.h"
 #include "core/Bonobo.h"
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 
 struct Cube {
     glm::vec3 corners[8]; // position of cube corners
     float values[8]; // values at cube corners
     glm::vec3 intersections[12]; // intersection points on edge
+    glm::vec3 normals[12]; // unnormalised normals at the intersection points, only used for gradient normals
 
 };
 
-TerrainMesh::TerrainMesh(TerrainGrid* grid)
+// The densities of a box of corners copied out of the grid, optionally with an apron of voxels around it for the gradients.
+// Reading the block is a lot cheaper than a bounds checked get() for every corner of every cube.
+struct DensityBlock {
+	glm::ivec3 min; // The grid position of the first value
+	glm::ivec3 size;
+	std::vector<float> values;
+
+	// Copies the corners of the cubes [origin, end) and apron voxels around them
+	void load(const TerrainGrid::Snapshot& densities, glm::ivec3 origin, glm::ivec3 end, int apron) {
+		min = origin - glm::ivec3(apron);
+		size = end - origin + glm::ivec3(1 + 2 * apron);
+		values.resize(size.x * size.y * size.z);
+		for (int z = 0; z < size.z; z++) {
+			for (int y = 0; y < size.y; y++) {
+				densities.getRow(min + glm::ivec3(0, y, z), size.x, &values[(z * size.y + y) * size.x]);
+			}
+		}
+	}
+
+	int rowIndex(int y, int z) const {
+		return (z - min.z) * size.y + (y - min.y);
+	}
+
+	// The values along +x starting at the given grid position
+	const float* row(int x, int y, int z) const {
+		return &values[rowIndex(y, z) * size.x + (x - min.x)];
+	}
+
+	float get(glm::ivec3 p) const {
+		return *row(p.x, p.y, p.z);
+	}
+
+	// The densities at the eight corners of the cube at the given grid position, in the corner order of Cube, from the four rows they lie on.
+	// Like get(), it doesn't check the bounds: the whole cube must be inside of the block.
+	void getCorners(int x, int y, int z, float* out) const {
+		const float* row00 = row(x, y, z);
+		const float* row10 = row00 + size.x; // One step along y
+		const float* row01 = row00 + size.x * size.y; // One step along z
+		const float* row11 = row01 + size.x;
+		out[0] = row00[0];
+		out[1] = row00[1];
+		out[2] = row10[1];
+		out[3] = row10[0];
+		out[4] = row01[0];
+		out[5] = row01[1];
+		out[6] = row11[1];
+		out[7] = row11[0];
+	}
+};
+
+// Which bricks of the grid (see TerrainGrid::getRange()) around a box of cubes can cross the iso level.
+// Looked up once per box, so that the rows of cubes only have to check a flag per brick.
+struct CrossingBricks {
+	glm::ivec3 min; // The first brick
+	glm::ivec3 counts;
+	std::vector<char> crosses;
+
+	// Finds the bricks around the cubes [origin, end), and returns whether any of them crosses
+	bool find(const TerrainGrid::Snapshot& densities, float isoLevel, glm::ivec3 origin, glm::ivec3 end) {
+		min = origin / TerrainGrid::BRICK_SIZE;
+		counts = (end - glm::ivec3(1)) / TerrainGrid::BRICK_SIZE - min + glm::ivec3(1);
+		crosses.resize(counts.x * counts.y * counts.z);
+		bool any = false;
+		for (int z = 0; z < counts.z; z++) {
+			for (int y = 0; y < counts.y; y++) {
+				for (int x = 0; x < counts.x; x++) {
+					glm::ivec3 brick = (min + glm::ivec3(x, y, z)) * TerrainGrid::BRICK_SIZE;
+					char& flag = crosses[(z * counts.y + y) * counts.x + x];
+					flag = densities.getRange(brick, brick + glm::ivec3(TerrainGrid::BRICK_SIZE)).crosses(isoLevel);
+					any |= flag != 0;
+				}
+			}
+		}
+		return any;
+	}
+
+	// Whether the brick containing the cube crosses
+	bool get(int x, int y, int z) const {
+		glm::ivec3 local = glm::ivec3(x, y, z) / TerrainGrid::BRICK_SIZE - min;
+		return crosses[(local.z * counts.y + local.y) * counts.x + local.x] != 0;
+	}
+};
+
+// Computes the cube indices of the cubes [startX, endX) of the row at y, z like MeshingKernels::classifyRow(),
+// but only classifies the parts of the row in bricks that can cross the iso level. The cubes in the other bricks get index 0.
+static bool classifyBrickRow(const DensityBlock& block, const CrossingBricks& bricks, float isoLevel, int startX, int endX, int y, int z, unsigned char* cubeIndices) {
+	bool intersected = false;
+	auto classify = [&](int runStart, int runEnd) {
+		intersected |= MeshingKernels::classifyRow(block.row(runStart, y, z), block.row(runStart, y + 1, z), block.row(runStart, y, z + 1), block.row(runStart, y + 1, z + 1),
+			runEnd - runStart, isoLevel, cubeIndices + (runStart - startX));
+	};
+
+	// Neighbouring bricks that cross are classified in one go
+	int runStart = -1; // The first cube of the current run of bricks that cross, -1 outside of a run
+	for (int x = startX; x < endX;) {
+		int brickEnd = glm::min((x / TerrainGrid::BRICK_SIZE + 1) * TerrainGrid::BRICK_SIZE, endX);
+		if (bricks.get(x, y, z)) {
+			if (runStart < 0) runStart = x;
+		}
+		else {
+			std::fill(cubeIndices + (x - startX), cubeIndices + (brickEnd - startX), 0);
+			if (runStart >= 0) classify(runStart, x);
+			runStart = -1;
+		}
+		x = brickEnd;
+	}
+	if (runStart >= 0) classify(runStart, endX);
+	return intersected;
+}
+
+static glm::vec3 normalizeOrZero(glm::vec3 n) {
+	float length = glm::length(n);
+	return length > 0.0f ? n / length : n; // Vertices of only degenerate triangles keep a zero normal
+}
+
+// The two corners of each cube edge, with the corner closest to the origin first.
+// Interpolating in this order gives a neighbouring cube the exact same vertex on a shared edge.
+static const int edgeCorners[12][2] = {
+	{0, 1}, {1, 2}, {3, 2}, {0, 3},
+	{4, 5}, {5, 6}, {7, 6}, {4, 7},
+	{0, 4}, {1, 5}, {2, 6}, {3, 7}
+};
+
+// The position of each cube corner relative to the first corner
+static const glm::ivec3 cornerOffsets[8] = {
+	glm::ivec3(0, 0, 0), glm::ivec3(1, 0, 0), glm::ivec3(1, 1, 0), glm::ivec3(0, 1, 0),
+	glm::ivec3(0, 0, 1), glm::ivec3(1, 0, 1), glm::ivec3(1, 1, 1), glm::ivec3(0, 1, 1)
+};
+
+// The axis (0 = x, 1 = y, 2 = z) each cube edge runs along
+static const int edgeAxis[12] = { 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 };
+
+TerrainMesh::TerrainMesh(TerrainGrid* grid, const ComputeMesher::Programs* computePrograms)
+	: algorithm(Algorithm::marchingCubes), indexed(false), normalMode(NormalMode::face), mappedUpload(false), vertexFormat(VertexFormat::full), lodDistance(0.0f), simplificationError(0.0f), simplificationDelay(2.0f), optimizeVertexCache(true), computeMeshing(false), chunkCounts(0), chunkedDimensions(0),
+	workers(WorkerPool::getMaxWorkerCount()), jobStage(JobStage::idle), stopMeshing(false), computeMesher(computePrograms, triCountTable, &triTable[0][0])
 {
     this->grid = grid;
-    this->vertexCount = 0;
 	this->isoLevel = 0.5;
+	meshingThread = std::thread([this]() { meshingLoop(); });
 
 	// Register with the grid to get notified about grid changes
-	// This means updateVBO() will be called any time the grid changes
-	grid->registerUpdateCallback([this]() { this->updateVBO(); });
+	// This means the chunks around the changed voxels will be regenerated any time the grid changes
+	grid->registerUpdateCallback([this](glm::ivec3 regionMin, glm::ivec3 regionMax) {
+		this->updateRegion(regionMin, regionMax);
+	});
 	updateVBO();
 };
 
+TerrainMesh::~TerrainMesh() {
+	discardJob();
+	{
+		std::lock_guard<std::mutex> lock(meshingMutex);
+		stopMeshing = true;
+	}
+	meshingCondition.notify_all();
+	meshingThread.join();
+	deleteChunks();
+}
+
 void TerrainMesh::setIsoLevel(float iso) {
 	if (isoLevel == iso) return;
 
+	float previousIsoLevel = isoLevel;
 	this->isoLevel = iso;
-	updateVBO();
+	if (computeMeshing || chunkedDimensions != grid->getDimensions()) {
+		updateVBO();
+		return;
+	}
+
+	// A chunk whose densities don't cross either iso level has no triangles at both of them, so it keeps its buffers.
+	// The others are regenerated, which while scrubbing the iso level only are the chunks around the surface.
+	for (int i = 0; i < static_cast<int>(chunks.size()); i++) {
+		TerrainGrid::DensityRange range = grid->getRange(chunks[i].origin, chunkEnd(chunks[i]));
+		if (range.crosses(previousIsoLevel) || range.crosses(iso)) {
+			markChunkDirty(i);
+		}
+	}
 }
 
 float TerrainMesh::getIsoLevel() const {
 	return isoLevel;
 }
 
+void TerrainMesh::setAlgorithm(Algorithm algorithm) {
+	if (this->algorithm == algorithm) return;
+
+	this->algorithm = algorithm;
+	updateVBO();
+}
+
+TerrainMesh::Algorithm TerrainMesh::getAlgorithm() const {
+	return algorithm;
+}
+
+void TerrainMesh::setWorkerCount(int count) {
+	// The meshing thread is the one using the workers
+	waitForMeshingThread();
+	workers.setWorkerCount(count);
+}
+
+int TerrainMesh::getWorkerCount() const {
+	return workers.getWorkerCount();
+}
+
+void TerrainMesh::setIndexed(bool indexed) {
+	if (this->indexed == indexed) return;
+
+	this->indexed = indexed;
+	updateVBO();
+}
+
+bool TerrainMesh::getIndexed() const {
+	return indexed;
+}
+
+void TerrainMesh::setNormalMode(NormalMode mode) {
+	if (normalMode == mode) return;
+
+	normalMode = mode;
+	updateVBO();
+}
+
+TerrainMesh::NormalMode TerrainMesh::getNormalMode() const {
+	return normalMode;
+}
+
+void TerrainMesh::setMappedUpload(bool mapped) {
+	if (mappedUpload == mapped) return;
+
+	mappedUpload = mapped;
+	updateVBO();
+}
+
+bool TerrainMesh::getMappedUpload() const {
+	return mappedUpload;
+}
+
+void TerrainMesh::setLodDistance(float distance) {
+	distance = std::max(distance, 0.0f);
+	if (lodDistance == distance) return;
+
+	// Turning it on or off switches between the mapped and unmapped generation, the levels themselves follow in draw()
+	bool wasMapped = getSettings().mapped;
+	lodDistance = distance;
+	if (getSettings().mapped != wasMapped) {
+		updateVBO();
+	}
+}
+
+float TerrainMesh::getLodDistance() const {
+	return lodDistance;
+}
+
+void TerrainMesh::setSimplificationError(float error) {
+	error = std::max(error, 0.0f);
+	if (simplificationError == error) return;
+
+	bool wasMapped = getSettings().mapped;
+	simplificationError = error;
+	if (getSettings().mapped != wasMapped) {
+		updateVBO();
+		return;
+	}
+	// Only the simplified chunks change, draw() picks the idle chunks to simplify once it is turned on
+	for (int i = 0; i < static_cast<int>(chunks.size()); i++) {
+		if (chunks[i].simplify) {
+			chunks[i].simplify = simplificationError > 0.0f;
+			markChunkDirty(i);
+		}
+	}
+}
+
+float TerrainMesh::getSimplificationError() const {
+	return simplificationError;
+}
+
+void TerrainMesh::setSimplificationDelay(float seconds) {
+	simplificationDelay = std::max(seconds, 0.0f);
+}
+
+float TerrainMesh::getSimplificationDelay() const {
+	return simplificationDelay;
+}
+
+void TerrainMesh::setOptimizeVertexCache(bool optimize) {
+	if (optimizeVertexCache == optimize) return;
+
+	optimizeVertexCache = optimize;
+	if (indexed || algorithm == Algorithm::surfaceNets) {
+		updateVBO();
+	}
+}
+
+bool TerrainMesh::getOptimizeVertexCache() const {
+	return optimizeVertexCache;
+}
+
+void TerrainMesh::setVertexFormat(VertexFormat format) {
+	if (vertexFormat == format) return;
+
+	vertexFormat = format;
+	updateVBO(); // Every chunk keeps its old format until its new mesh is swapped in
+}
+
+TerrainMesh::VertexFormat TerrainMesh::getVertexFormat() const {
+	return vertexFormat;
+}
+
+size_t TerrainMesh::getVertexSize() const {
+	return getVertexSize(vertexFormat);
+}
+
+size_t TerrainMesh::getVertexSize(VertexFormat format) {
+	return format == VertexFormat::compact ? 8 : 6 * sizeof(float);
+}
+
+void TerrainMesh::setComputeMeshing(bool compute) {
+	if (computeMeshing == compute) return;
+	if (compute && !isComputeMeshingAvailable()) {
+		LogWarning("Compute meshing needs OpenGL 4.3 and the marching cubes compute programs, staying with the CPU mesh");
+		return;
+	}
+
+	computeMeshing = compute;
+	if (computeMeshing) {
+		// The chunks are not used until compute meshing is turned off again, so give their memory back
+		discardJob();
+		deleteChunks();
+		std::vector<ChunkMeshData>().swap(job.meshes);
+		chunkCounts = glm::ivec3(0);
+		chunkedDimensions = glm::ivec3(0);
+		computeMesher.invalidate(glm::ivec3(0), grid->getDimensions());
+	}
+	else {
+		computeMesher.release();
+		updateVBO();
+	}
+}
+
+bool TerrainMesh::getComputeMeshing() const {
+	return computeMeshing;
+}
+
+bool TerrainMesh::isComputeMeshingAvailable() const {
+	return computeMesher.isAvailable();
+}
+
+void TerrainMesh::finishMeshing() {
+	if (computeMeshing) return;
+
+	if (chunkedDimensions != grid->getDimensions()) {
+		updateVBO();
+	}
+	while (true) {
+		updateMeshing();
+		std::unique_lock<std::mutex> lock(meshingMutex);
+		if (jobStage == JobStage::idle && dirtyChunks.empty()) return;
+		meshingCondition.wait(lock, [this]() { return jobStage != JobStage::generating && jobStage != JobStage::filling; });
+	}
+}
+
+std::vector<std::pair<MeshingKernels::Instructions, double>> TerrainMesh::benchmarkClassification() const {
+	std::vector<std::pair<MeshingKernels::Instructions, double>> results;
+
+	glm::ivec3 dimensions = grid->getDimensions();
+	if (dimensions.x < 2 || dimensions.y < 2 || dimensions.z < 2) return results;
+
+	// Classify from a copy of the grid, so that only the classification itself is measured
+	std::vector<float> densities(dimensions.x * dimensions.y * dimensions.z);
+	for (int z = 0; z < dimensions.z; z++) {
+		for (int y = 0; y < dimensions.y; y++) {
+			grid->getRow(glm::ivec3(0, y, z), dimensions.x, &densities[(z * dimensions.y + y) * dimensions.x]);
+		}
+	}
+	auto row = [&](int y, int z) { return &densities[(z * dimensions.y + y) * dimensions.x]; };
+	std::vector<unsigned char> cubeIndices(dimensions.x - 1);
+	double cubesPerPass = double(dimensions.x - 1) * (dimensions.y - 1) * (dimensions.z - 1);
+
+	for (MeshingKernels::Instructions instructions : { MeshingKernels::Instructions::scalar, MeshingKernels::Instructions::sse4, MeshingKernels::Instructions::avx2 }) {
+		if (!MeshingKernels::isSupported(instructions)) continue;
+
+		// Repeat the whole grid until enough time has passed to get a stable number
+		int passes = 0;
+		int activeRows = 0; // Used so that the compiler can't leave out the classification
+		auto start = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double> elapsed(0.0);
+		while (elapsed.count() < 0.25) {
+			for (int z = 0; z < dimensions.z - 1; z++) {
+				for (int y = 0; y < dimensions.y - 1; y++) {
+					activeRows += MeshingKernels::classifyRow(instructions, row(y, z), row(y + 1, z), row(y, z + 1), row(y + 1, z + 1), dimensions.x - 1, isoLevel, cubeIndices.data());
+				}
+			}
+			passes++;
+			elapsed = std::chrono::high_resolution_clock::now() - start;
+		}
+
+		double cubesPerSecond = cubesPerPass * passes / elapsed.count();
+		LogInfo("Cube classification (%s): %.1f million cubes/s, %d of %d rows intersect the surface",
+			MeshingKernels::getName(instructions), cubesPerSecond / 1e6, activeRows / passes, (dimensions.y - 1) * (dimensions.z - 1));
+		results.push_back(std::make_pair(instructions, cubesPerSecond));
+	}
+	return results;
+}
+
+std::vector<TerrainMesh::MesherBenchmark> TerrainMesh::benchmarkMeshers() {
+	std::vector<MesherBenchmark> results;
+	if (computeMeshing || chunkedDimensions != grid->getDimensions()) return results;
+
+	// The meshing thread is the one using the workers otherwise
+	waitForMeshingThread();
+
+	std::vector<ChunkMeshData> meshes(chunks.size());
+	size_t vertexSize = getVertexSize();
+
+	for (Algorithm benchmarked : { Algorithm::marchingCubes, Algorithm::surfaceNets }) {
+		MeshSettings settings = getSettings();
+		settings.algorithm = benchmarked;
+		settings.indexed = indexed || benchmarked == Algorithm::surfaceNets;
+
+		// Including the copies of the chunks' voxels, just like the meshing jobs
+		auto start = std::chrono::high_resolution_clock::now();
+		workers.parallelFor(static_cast<int>(chunks.size()), [&](int i) {
+			generateChunk(chunks[i], settings, &meshes[i]);
+		});
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		MesherBenchmark result = { benchmarked, 0, 0, 0, elapsed.count() };
+		for (const ChunkMeshData& mesh : meshes) {
+			size_t vertexCount = mesh.vertices.size() / 6;
+			result.vertices += vertexCount;
+			if (settings.indexed) {
+				result.triangles += mesh.indices.size() / 3;
+				result.bytes += vertexCount * vertexSize + mesh.indices.size() * (vertexCount <= 0xFFFF ? sizeof(unsigned short) : sizeof(unsigned int));
+			}
+			else {
+				result.triangles += vertexCount / 3;
+				result.bytes += vertexCount * vertexSize;
+			}
+		}
+		LogInfo("%s: %zu triangles, %zu vertices, %.1f MB in %.1f ms", benchmarked == Algorithm::surfaceNets ? "Surface nets" : "Marching cubes",
+			result.triangles, result.vertices, result.bytes / (1024.0 * 1024.0), result.milliseconds);
+		results.push_back(result);
+	}
+	return results;
+}
+
+std::vector<TerrainMesh::SimplificationBenchmark> TerrainMesh::benchmarkSimplification() {
+	std::vector<SimplificationBenchmark> results;
+	if (computeMeshing || chunkedDimensions != grid->getDimensions()) return results;
+
+	// The meshing thread is the one using the workers otherwise
+	waitForMeshingThread();
+
+	MeshSettings settings = getSettings();
+	float scale = grid->getScale();
+	std::vector<ChunkMeshData> fullMeshes(chunks.size());
+	workers.parallelFor(static_cast<int>(chunks.size()), [&](int i) {
+		generateChunk(chunks[i], settings, &fullMeshes[i]);
+	});
+	auto triangleCount = [&settings](const ChunkMeshData& mesh) { return settings.indexed ? mesh.indices.size() / 3 : mesh.vertices.size() / 18; };
+	size_t trianglesBefore = 0;
+	for (const ChunkMeshData& mesh : fullMeshes) {
+		trianglesBefore += triangleCount(mesh);
+	}
+
+	// The errors are in cubes of the grid
+	std::vector<ChunkMeshData> meshes(chunks.size());
+	std::vector<float> errors(chunks.size());
+	for (float cubes : { 0.05f, 0.1f, 0.25f, 0.5f, 1.0f, 2.0f }) {
+		settings.simplificationError = cubes * scale;
+		for (size_t i = 0; i < chunks.size(); i++) {
+			meshes[i].vertices = fullMeshes[i].vertices;
+			meshes[i].indices = fullMeshes[i].indices;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		workers.parallelFor(static_cast<int>(chunks.size()), [&](int i) {
+			errors[i] = simplifyMesh(&meshes[i], settings, scale);
+		});
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		SimplificationBenchmark result = { settings.simplificationError, trianglesBefore, 0, 0.0f, elapsed.count() };
+		for (size_t i = 0; i < chunks.size(); i++) {
+			result.trianglesAfter += triangleCount(meshes[i]);
+			result.error = std::max(result.error, errors[i]);
+		}
+		LogInfo("Simplified to %.3f: %zu -> %zu triangles (%.1f%%), error %.3f in %.1f ms", result.targetError, result.trianglesBefore, result.trianglesAfter,
+			100.0 * result.trianglesAfter / std::max<size_t>(result.trianglesBefore, 1), result.error, result.milliseconds);
+		results.push_back(result);
+	}
+	return results;
+}
+
+std::vector<TerrainMesh::VertexCacheBenchmark> TerrainMesh::benchmarkVertexCache() {
+	std::vector<VertexCacheBenchmark> results;
+	if (computeMeshing || chunkedDimensions != grid->getDimensions()) return results;
+
+	// The meshing thread is the one using the workers otherwise
+	waitForMeshingThread();
+
+	MeshSettings settings = getSettings();
+	settings.indexed = true;
+	settings.simplificationError = 0.0f;
+	std::vector<ChunkMeshData> meshes(chunks.size());
+	workers.parallelFor(static_cast<int>(chunks.size()), [&](int i) {
+		generateChunk(chunks[i], settings, &meshes[i]);
+	});
+
+	for (bool optimized : { false, true }) {
+		double milliseconds = 0.0;
+		if (optimized) {
+			auto start = std::chrono::high_resolution_clock::now();
+			workers.parallelFor(static_cast<int>(chunks.size()), [&](int i) {
+				optimizeMesh(&meshes[i]);
+			});
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+			milliseconds = elapsed.count();
+		}
+
+		MeshOptimizer::CacheStatistics total = { 0, 0, 0 };
+		for (const ChunkMeshData& mesh : meshes) {
+			MeshOptimizer::CacheStatistics statistics = MeshOptimizer::analyzeVertexCache(mesh.indices, mesh.vertices.size() / 6, MeshOptimizer::SIMULATED_CACHE_SIZE);
+			total.misses += statistics.misses;
+			total.triangles += statistics.triangles;
+			total.vertices += statistics.vertices;
+		}
+		VertexCacheBenchmark result = { optimized, total.getAcmr(), total.getAtvr(), milliseconds };
+		LogInfo("%s order: ACMR %.3f, ATVR %.3f with a %d vertex cache (%.1f ms)", optimized ? "Optimised" : "Generated",
+			result.acmr, result.atvr, MeshOptimizer::SIMULATED_CACHE_SIZE, result.milliseconds);
+		results.push_back(result);
+	}
+	return results;
+}
+
+bool TerrainMesh::exportMesh(const std::string& path, MeshExporter::Format format) {
+	glm::ivec3 dimensions = grid->getDimensions();
+	glm::ivec3 cubes = dimensions - glm::ivec3(1);
+	if (cubes.x < 1 || cubes.y < 1 || cubes.z < 1) return false;
+
+	// The meshing thread is the one using the workers otherwise
+	waitForMeshingThread();
+
+	MeshExporter exporter;
+	if (!exporter.open(path, format)) {
+		LogWarning("Couldn't open %s for the export", path.c_str());
+		return false;
+	}
+
+	// Always share the vertices within a chunk, the full mesh would repeat them for each triangle around them
+	MeshSettings settings = getSettings();
+	settings.indexed = true;
+	settings.vertexFormat = VertexFormat::full;
+	settings.mapped = false;
+	settings.simplificationError = 0.0f;
+
+	glm::ivec3 chunkCounts = (cubes + glm::ivec3(CHUNK_SIZE - 1)) / CHUNK_SIZE;
+	int chunkCount = chunkCounts.x * chunkCounts.y * chunkCounts.z;
+	// Enough chunks per batch to keep every worker busy, while the meshes of the batch stay small
+	int batchSize = workers.getWorkerCount() * 4;
+	std::vector<ChunkMeshData> meshes(batchSize);
+	std::vector<TerrainGrid::Snapshot> densities(batchSize);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int first = 0; first < chunkCount; first += batchSize) {
+		int count = std::min(batchSize, chunkCount - first);
+		workers.parallelFor(count, [&](int i) {
+			int chunk = first + i;
+			glm::ivec3 origin = glm::ivec3(chunk % chunkCounts.x, (chunk / chunkCounts.x) % chunkCounts.y, chunk / (chunkCounts.x * chunkCounts.y)) * CHUNK_SIZE;
+			glm::ivec3 end = glm::min(origin + glm::ivec3(CHUNK_SIZE), cubes);
+			meshes[i].vertices.clear();
+			meshes[i].indices.clear();
+			if (!grid->getRange(origin, end).crosses(settings.isoLevel)) return;
+
+			// Only the chunk and its apron are copied, never the whole grid
+			grid->copyRegion(glm::max(origin - glm::ivec3(1), glm::ivec3(0)), glm::min(end + glm::ivec3(2), dimensions), densities[i]);
+			generateMesh(densities[i], settings, origin, end, &meshes[i]);
+			if (settings.optimizeVertexCache) {
+				optimizeMesh(&meshes[i]);
+			}
+		});
+
+		// In chunk order, so the file is the same for any amount of workers
+		for (int i = 0; i < count; i++) {
+			if (!exporter.addBlock(meshes[i].vertices, meshes[i].indices)) {
+				LogWarning("Couldn't write the export to %s", path.c_str());
+				return false;
+			}
+		}
+	}
+	size_t vertexCount = exporter.getVertexCount();
+	size_t triangleCount = exporter.getTriangleCount();
+	if (!exporter.finish()) {
+		LogWarning("Couldn't write the export to %s", path.c_str());
+		return false;
+	}
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+	LogInfo("Exported %zu triangles and %zu vertices to %s in %.1f ms", triangleCount, vertexCount, path.c_str(), elapsed.count());
+	return true;
+}
+
+void TerrainMesh::generateRegion(const TerrainGrid::Snapshot& densities, float isoLevel, Algorithm algorithm, bool indexed, NormalMode normalMode,
+	glm::ivec3 origin, glm::ivec3 end, std::vector<float>& vertices, std::vector<unsigned int>& indices) {
+	MeshSettings settings;
+	settings.isoLevel = isoLevel;
+	settings.algorithm = algorithm;
+	settings.indexed = indexed || algorithm == Algorithm::surfaceNets;
+	settings.normalMode = normalMode;
+	settings.vertexFormat = VertexFormat::full;
+	settings.mapped = false;
+	settings.simplificationError = 0.0f;
+	settings.optimizeVertexCache = false;
+
+	// Generate straight into the given vectors, reusing their memory
+	ChunkMeshData mesh;
+	mesh.vertices.swap(vertices);
+	mesh.indices.swap(indices);
+	mesh.vertices.clear();
+	mesh.indices.clear();
+	generateMesh(densities, settings, origin, end, &mesh);
+	vertices.swap(mesh.vertices);
+	indices.swap(mesh.indices);
+}
+
 int TerrainMesh::edgeTable[256] = {
 
 0x0  , 0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c,
@@ -329,20 +934,67 @@ int TerrainMesh::triTable[256][16] = {
 
 };
 
-glm::vec3 TerrainMesh::vertexInterpolation(glm::vec3& p1, glm::vec3& p2, float valp1, float valp2) {
 
-    if (fabs(isoLevel - valp1) < 0.00001f) return p1; // p1 is basically on isoLevel
-    if (fabs(isoLevel - valp2) < 0.00001f) return p2; // p2 is basically on isoLevel
-    if (fabs(valp1 - valp2) < 0.00001f) return p1; // p1 and p2 are basically at same level
+// The amount of triangles in each row of triTable
+int TerrainMesh::triCountTable[256] = {
+
+0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 2,
+1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 3,
+1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 3,
+2, 3, 3, 2, 3, 4, 4, 3, 3, 4, 4, 3, 4, 5, 5, 2,
+1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 3,
+2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 4,
+2, 3, 3, 4, 3, 4, 2, 3, 3, 4, 4, 5, 4, 5, 3, 2,
+3, 4, 4, 3, 4, 5, 3, 2, 4, 5, 5, 4, 5, 2, 4, 1,
+1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 3,
+2, 3, 3, 4, 3, 4, 4, 5, 3, 2, 4, 3, 4, 3, 5, 2,
+2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 4,
+3, 4, 4, 3, 4, 5, 5, 4, 4, 3, 5, 2, 5, 4, 2, 1,
+2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 2, 3, 3, 2,
+3, 4, 4, 5, 4, 5, 5, 2, 4, 3, 5, 4, 3, 2, 4, 1,
+3, 4, 4, 5, 4, 5, 3, 4, 4, 5, 5, 2, 3, 4, 2, 1,
+2, 3, 3, 2, 3, 4, 2, 1, 3, 2, 4, 1, 2, 1, 1, 0
+
+};
 
-    float t = (isoLevel - valp1) / (valp2 - valp1); // find t
-    return p1 + (p2 - p1) * t; // get position
+glm::vec3 TerrainMesh::vertexInterpolation(float isoLevel, glm::vec3& p1, glm::vec3& p2, float valp1, float valp2) {
+    return p1 + (p2 - p1) * interpolationFactor(isoLevel, valp1, valp2); // get position
 };
 
+float TerrainMesh::interpolationFactor(float isoLevel, float valp1, float valp2) {
+
+    if (fabs(isoLevel - valp1) < 0.00001f) return 0.0f; // p1 is basically on isoLevel
+    if (fabs(isoLevel - valp2) < 0.00001f) return 1.0f; // p2 is basically on isoLevel
+    if (fabs(valp1 - valp2) < 0.00001f) return 0.0f; // p1 and p2 are basically at same level
+
+    return (isoLevel - valp1) / (valp2 - valp1); // find t
+}
+
 
 void TerrainMesh::draw(FPSCameraf* camera, GLuint shader, float max_y) {
-	if (vao == 0) {
-		updateVBO();
+	if (computeMeshing) {
+		computeMesher.update(grid, isoLevel, normalMode == NormalMode::gradient);
+	}
+	else {
+		if (chunkedDimensions != grid->getDimensions()) {
+			updateVBO();
+		}
+		// Regenerate the chunks whose level of detail changed as the camera moved, and the ones that became idle enough to simplify
+		glm::vec3 cameraPosition = camera->mWorld.GetTranslation();
+		auto now = std::chrono::steady_clock::now();
+		for (int i = 0; i < static_cast<int>(chunks.size()); i++) {
+			int level = chooseLevel(chunks[i], cameraPosition);
+			if (level != chunks[i].targetLevel) {
+				chunks[i].targetLevel = level;
+				markChunkDirty(i);
+			}
+			if (simplificationError > 0.0f && !chunks[i].simplify &&
+				std::chrono::duration<float>(now - chunks[i].lastEdit).count() >= simplificationDelay) {
+				chunks[i].simplify = true;
+				markChunkDirty(i);
+			}
+		}
+		updateMeshing(); // Swap in the chunks the meshing thread finished
 	}
 
     auto light_direction = glm::normalize(glm::vec3(0.0f, 1.0f, 0.0f));
@@ -354,29 +1006,752 @@ void TerrainMesh::draw(FPSCameraf* camera, GLuint shader, float max_y) {
     glUniform3fv(glGetUniformLocation(shader, "camera_position"), 1, glm::value_ptr(camera->mWorld.GetTranslation()));
 	glUniform1fv(glGetUniformLocation(shader, "max_y"), 1, &max_y);
 
-	glBindVertexArray(vao);
-	glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+	// Compact positions are stored relative to their chunk, in fractions of the chunk size (plus the margin around it, see getCompactBox()).
+	// The format is set per chunk, as chunks keep their old format until they are regenerated.
+	GLint positionOffsetLocation = glGetUniformLocation(shader, "position_offset");
+	GLint positionScaleLocation = glGetUniformLocation(shader, "position_scale");
+	GLint octahedralNormalsLocation = glGetUniformLocation(shader, "octahedral_normals");
+
+	if (computeMeshing) {
+		glUniform3fv(positionOffsetLocation, 1, glm::value_ptr(glm::vec3(0.0f)));
+		glUniform1f(positionScaleLocation, 1.0f);
+		glUniform1i(octahedralNormalsLocation, 0);
+		computeMesher.draw();
+	}
+
+	// Front to back, so that the depth test can skip the hidden fragments of the chunks behind
+	glm::vec3 cameraPosition = camera->mWorld.GetTranslation();
+	drawOrder.clear();
+	for (int i = 0; i < static_cast<int>(chunks.size()); i++) {
+		if (chunks[i].vertexCount == 0) continue; // Entirely inside or outside of the terrain
+
+		glm::vec3 center = glm::vec3(chunks[i].origin + chunkEnd(chunks[i])) * (0.5f * grid->getScale());
+		glm::vec3 offset = center - cameraPosition;
+		drawOrder.push_back(std::make_pair(glm::dot(offset, offset), i));
+	}
+	std::sort(drawOrder.begin(), drawOrder.end());
+
+	for (const std::pair<float, int>& entry : drawOrder) {
+		const Chunk& chunk = chunks[entry.second];
+		bool compact = chunk.vertexFormat == VertexFormat::compact;
+		glm::vec3 positionOffset(0.0f);
+		float positionScale = 1.0f;
+		if (compact) {
+			getCompactBox(chunk.origin, chunk.level, grid->getScale(), positionOffset, positionScale);
+		}
+		glUniform3fv(positionOffsetLocation, 1, glm::value_ptr(positionOffset));
+		glUniform1f(positionScaleLocation, positionScale);
+		glUniform1i(octahedralNormalsLocation, compact ? 1 : 0);
+		glBindVertexArray(chunk.vao);
+		if (chunk.indexCount > 0) {
+			glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(chunk.indexCount), chunk.indexType, reinterpret_cast<void*>(chunk.indices.offset));
+		}
+		else {
+			glDrawArrays(GL_TRIANGLES, 0, static_cast<GLsizei>(chunk.vertexCount));
+		}
+	}
 	glBindVertexArray(0); //Unbind the VBO and shader to prevent accidental use in the next draw()
 	glUseProgram(0);
 }
 
 void TerrainMesh::updateVBO() {
+	if (computeMeshing) {
+		// The ComputeMesher regenerates the mesh on the next draw
+		computeMesher.invalidateMesh();
+		return;
+	}
 	LogInfo("Updating mesh VBO");
 
-	if (vbo != 0) {
-		glDeleteBuffers(1, &vbo);
-		glDeleteVertexArrays(1, &vao);
+	if (chunkedDimensions != grid->getDimensions()) {
+		resizeChunks();
+	}
+
+	for (int i = 0; i < static_cast<int>(chunks.size()); i++) {
+		markChunkDirty(i);
+	}
+}
+
+void TerrainMesh::updateRegion(glm::ivec3 voxelMin, glm::ivec3 voxelMax) {
+	if (computeMeshing) {
+		// The ComputeMesher uploads the changed voxels and regenerates the mesh on the next draw
+		computeMesher.invalidate(voxelMin, voxelMax);
+		return;
+	}
+	if (chunkedDimensions != grid->getDimensions()) {
+		// The chunks no longer match the grid, so everything has to be regenerated. draw() does that once it sees the new dimensions.
+		return;
+	}
+	if (voxelMin.x >= voxelMax.x || voxelMin.y >= voxelMax.y || voxelMin.z >= voxelMax.z) return;
+
+	// A voxel is a corner of the cubes just before and just after it, so the cubes [voxelMin - 1, voxelMax) use the changed voxels.
+	// One more voxel of apron on each side keeps the chunks right next to the edit consistent as well.
+	// The coarser levels of detail read every stride-th voxel and an apron of stride voxels, so their chunks reach further.
+	const int maxStride = 1 << MAX_LEVEL;
+	glm::ivec3 cubeMin = voxelMin - glm::ivec3(maxStride + 1);
+	glm::ivec3 cubeMax = voxelMax + glm::ivec3(maxStride);
+
+	// Find the range of chunks that could contain those cubes.
+	// The chunks that are regenerated are edited, so they go back to the full mesh until they are idle again.
+	auto now = std::chrono::steady_clock::now();
+	glm::ivec3 chunkMin = glm::clamp(cubeMin / CHUNK_SIZE, glm::ivec3(0), chunkCounts - glm::ivec3(1));
+	glm::ivec3 chunkMax = glm::clamp((cubeMax - glm::ivec3(1)) / CHUNK_SIZE, glm::ivec3(0), chunkCounts - glm::ivec3(1));
+
+	for (int cz = chunkMin.z; cz <= chunkMax.z; cz++) {
+		for (int cy = chunkMin.y; cy <= chunkMax.y; cy++) {
+			for (int cx = chunkMin.x; cx <= chunkMax.x; cx++) {
+				int chunkIndex = cx + cy * chunkCounts.x + cz * chunkCounts.x * chunkCounts.y;
+				glm::ivec3 readMin, readMax;
+				getReadBox(chunks[chunkIndex], chunks[chunkIndex].targetLevel, readMin, readMax);
+				if (readMin.x < voxelMax.x && readMin.y < voxelMax.y && readMin.z < voxelMax.z &&
+					readMax.x > voxelMin.x && readMax.y > voxelMin.y && readMax.z > voxelMin.z) {
+					chunks[chunkIndex].lastEdit = now;
+					chunks[chunkIndex].simplify = false;
+					markChunkDirty(chunkIndex);
+				}
+			}
+		}
+	}
+}
+
+void TerrainMesh::markChunkDirty(int chunkIndex) {
+	if (chunkDirty[chunkIndex]) return;
+
+	chunkDirty[chunkIndex] = 1;
+	dirtyChunks.push_back(chunkIndex);
+}
+
+TerrainMesh::MeshSettings TerrainMesh::getSettings() const {
+	MeshSettings settings;
+	settings.isoLevel = isoLevel;
+	settings.algorithm = algorithm;
+	settings.indexed = indexed || algorithm == Algorithm::surfaceNets;
+	settings.normalMode = normalMode;
+	settings.vertexFormat = vertexFormat;
+	// The coarser levels are downsampled and the simplified chunks simplified in memory first
+	settings.mapped = mappedUpload && !settings.indexed && lodDistance <= 0.0f && simplificationError <= 0.0f;
+	settings.simplificationError = simplificationError;
+	settings.optimizeVertexCache = optimizeVertexCache;
+	return settings;
+}
+
+void TerrainMesh::updateMeshing() {
+	JobStage stage;
+	{
+		std::lock_guard<std::mutex> lock(meshingMutex);
+		stage = jobStage;
+	}
+
+	// Only the render thread moves the job out of these stages, so they can't change in the meantime
+	if (stage == JobStage::allocating) {
+		allocateJobRanges();
+	}
+	else if (stage == JobStage::done) {
+		finishJob();
+		stage = JobStage::idle;
+	}
+
+	if (stage == JobStage::idle && !dirtyChunks.empty()) {
+		startJob();
 	}
+}
+
+void TerrainMesh::startJob() {
+	// Take the dirty chunks in the order they were marked, until the voxels they read fill the job. The others wait for the next job,
+	// so that even remeshing all of a huge grid only copies a bounded part of it on the render thread at a time.
+	// The chunks without any surface in those voxels have nothing to mesh, so they don't copy any.
+	job.chunkIndices.clear();
+	size_t voxelCount = 0;
+	size_t takenCount = 0;
+	for (; takenCount < dirtyChunks.size(); takenCount++) {
+		int chunkIndex = dirtyChunks[takenCount];
+		glm::ivec3 readMin, readMax;
+		getReadBox(chunks[chunkIndex], chunks[chunkIndex].targetLevel, readMin, readMax);
+		glm::ivec3 size = readMax - readMin;
+		size_t chunkVoxels = grid->getRange(readMin, readMax - glm::ivec3(1)).crosses(isoLevel) ? static_cast<size_t>(size.x) * size.y * size.z : 0;
+		if (voxelCount > 0 && voxelCount + chunkVoxels > static_cast<size_t>(MAX_JOB_VOXELS)) break;
+
+		voxelCount += chunkVoxels;
+		chunkDirty[chunkIndex] = 0;
+		job.chunkIndices.push_back(chunkIndex);
+	}
+	dirtyChunks.erase(dirtyChunks.begin(), dirtyChunks.begin() + takenCount);
+
+	// In grid order, so that the neighbouring chunks along x are next to each other and can share the voxels around them
+	std::sort(job.chunkIndices.begin(), job.chunkIndices.end());
+	job.settings = getSettings();
+	job.levels.clear();
+	job.simplify.clear();
+	job.snapshots.clear();
+
+	// Copy every voxel the chunks read, including the apron around them for the gradients.
+	// The apron is one voxel of the chunk's level of detail, so it is wider for the coarser chunks.
+	int snapshotCount = 0;
+	int groupSize = 0;
+	glm::ivec3 groupMin, groupMax;
+	auto copyGroup = [&]() {
+		if (groupSize == 0) return;
+		if (job.densities.size() < static_cast<size_t>(snapshotCount)) {
+			job.densities.resize(snapshotCount);
+		}
+		grid->copyRegion(groupMin, groupMax, job.densities[snapshotCount - 1]);
+		groupSize = 0;
+	};
+	for (size_t i = 0; i < job.chunkIndices.size(); i++) {
+		int chunkIndex = job.chunkIndices[i];
+		const Chunk& chunk = chunks[chunkIndex];
+		job.levels.push_back(chunk.targetLevel);
+		job.simplify.push_back(chunk.simplify);
+
+		glm::ivec3 readMin, readMax;
+		getReadBox(chunk, chunk.targetLevel, readMin, readMax);
+		if (!grid->getRange(readMin, readMax - glm::ivec3(1)).crosses(isoLevel)) {
+			job.snapshots.push_back(-1);
+			continue;
+		}
+
+		// A chunk right after the previous one along x joins its snapshot, until the group is full
+		bool nextAlongX = i > 0 && job.chunkIndices[i - 1] == chunkIndex - 1 && chunk.origin.x > 0 && job.snapshots.back() >= 0;
+		if (nextAlongX && groupSize < MAX_GROUP_CHUNKS) {
+			groupMin = glm::min(groupMin, readMin);
+			groupMax = glm::max(groupMax, readMax);
+			groupSize++;
+		}
+		else {
+			copyGroup();
+			groupMin = readMin;
+			groupMax = readMax;
+			groupSize = 1;
+			snapshotCount++;
+		}
+		job.snapshots.push_back(snapshotCount - 1);
+	}
+	copyGroup();
+
+	{
+		std::lock_guard<std::mutex> lock(meshingMutex);
+		jobStage = JobStage::generating;
+	}
+	meshingCondition.notify_all();
+}
+
+void TerrainMesh::allocateJobRanges() {
+	// Each chunk gets a new range of exactly the counted size from the buffer arena, which the slabs write to directly if it is persistently mapped.
+	// Otherwise they write to staging memory (laid out by a prefix sum over the chunks) that is uploaded afterwards.
+	// The old ranges are still drawn until the job is done.
+	int chunkCount = static_cast<int>(job.chunkIndices.size());
+	size_t vertexSize = getVertexSize(job.settings.vertexFormat);
+	job.ranges.resize(chunkCount);
+	job.mappings.assign(chunkCount, nullptr);
+	std::vector<size_t> stagingOffsets(chunkCount, 0);
+	size_t stagingSize = 0;
+	for (int i = 0; i < chunkCount; i++) {
+		job.ranges[i] = buffers.Allocate(static_cast<GLsizeiptr>(job.vertexCounts[i] * vertexSize));
+		job.mappings[i] = static_cast<unsigned char*>(buffers.GetPointer(job.ranges[i]));
+		if (!job.mappings[i]) {
+			stagingOffsets[i] = stagingSize;
+			stagingSize += job.vertexCounts[i] * vertexSize;
+		}
+	}
+	if (stagingSize > 0) {
+		job.staging.resize(stagingSize);
+		for (int i = 0; i < chunkCount; i++) {
+			if (!job.mappings[i] && job.vertexCounts[i] > 0) {
+				job.mappings[i] = &job.staging[stagingOffsets[i]];
+			}
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(meshingMutex);
+		jobStage = JobStage::filling;
+	}
+	meshingCondition.notify_all();
+}
+
+void TerrainMesh::finishJob() {
+	int chunkCount = static_cast<int>(job.chunkIndices.size());
+	size_t vertexSize = getVertexSize(job.settings.vertexFormat);
+
+	// Swap in the new mesh of each chunk, this has to happen on the thread that owns the OpenGL context
+	for (int i = 0; i < chunkCount; i++) {
+		Chunk& chunk = chunks[job.chunkIndices[i]];
+		buffers.Free(chunk.vertices);
+		buffers.Free(chunk.indices);
+		chunk.vertexFormat = job.settings.vertexFormat;
+		chunk.level = job.levels[i];
+
+		if (job.settings.mapped) {
+			chunk.vertexCount = job.vertexCounts[i];
+			chunk.indexCount = 0;
+			chunk.vertices = job.ranges[i];
+			if (job.mappings[i] && job.mappings[i] != buffers.GetPointer(chunk.vertices)) {
+				buffers.Upload(chunk.vertices, job.mappings[i], chunk.vertices.size);
+			}
+			setVertexAttributes(chunk);
+			continue;
+		}
+
+		const ChunkMeshData& mesh = job.meshes[i];
+		chunk.vertexCount = mesh.vertices.size() / 6; // Every vertex is a position and a normal
+		chunk.indexCount = mesh.indices.size();
+
+		chunk.vertices = buffers.Allocate(static_cast<GLsizeiptr>(chunk.vertexCount * vertexSize));
+		if (chunk.vertexFormat == VertexFormat::compact) {
+			buffers.Upload(chunk.vertices, mesh.packedVertices.data(), mesh.packedVertices.size());
+		}
+		else {
+			buffers.Upload(chunk.vertices, mesh.vertices.data(), mesh.vertices.size() * sizeof(float));
+		}
+
+		if (job.settings.indexed) {
+			if (chunk.vertexCount <= 0xFFFF) {
+				// Most chunks have few enough vertices to halve the size of the indices
+				shortIndices.assign(mesh.indices.begin(), mesh.indices.end());
+				chunk.indexType = GL_UNSIGNED_SHORT;
+				chunk.indices = buffers.Allocate(shortIndices.size() * sizeof(unsigned short));
+				buffers.Upload(chunk.indices, shortIndices.data(), shortIndices.size() * sizeof(unsigned short));
+			}
+			else {
+				chunk.indexType = GL_UNSIGNED_INT;
+				chunk.indices = buffers.Allocate(mesh.indices.size() * sizeof(unsigned int));
+				buffers.Upload(chunk.indices, mesh.indices.data(), mesh.indices.size() * sizeof(unsigned int));
+			}
+		}
+
+		setVertexAttributes(chunk);
+	}
+
+	if (job.settings.mapped) {
+		std::vector<ChunkMeshData>().swap(job.meshes); // The meshes are not used in mapped mode, so give their memory back
+	}
+
+	// The old ranges become available again once the GPU finished drawing them
+	buffers.Retire();
+
+	std::lock_guard<std::mutex> lock(meshingMutex);
+	jobStage = JobStage::idle;
+}
+
+void TerrainMesh::discardJob() {
+	waitForMeshingThread();
+
+	std::lock_guard<std::mutex> lock(meshingMutex);
+	if (jobStage == JobStage::done && job.settings.mapped) {
+		for (BufferArena::Allocation& range : job.ranges) {
+			buffers.Free(range);
+		}
+		buffers.Retire();
+	}
+	jobStage = JobStage::idle;
+}
+
+void TerrainMesh::waitForMeshingThread() {
+	std::unique_lock<std::mutex> lock(meshingMutex);
+	meshingCondition.wait(lock, [this]() { return jobStage != JobStage::generating && jobStage != JobStage::filling; });
+}
+
+void TerrainMesh::meshingLoop() {
+	while (true) {
+		JobStage stage;
+		{
+			std::unique_lock<std::mutex> lock(meshingMutex);
+			meshingCondition.wait(lock, [this]() { return stopMeshing || jobStage == JobStage::generating || jobStage == JobStage::filling; });
+			if (stopMeshing) return;
+			stage = jobStage;
+		}
+
+		if (stage == JobStage::generating) {
+			generateJob();
+		}
+		else {
+			fillJob();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(meshingMutex);
+			jobStage = stage == JobStage::generating && job.settings.mapped ? JobStage::allocating : JobStage::done;
+		}
+		meshingCondition.notify_all();
+	}
+}
+
+void TerrainMesh::generateJob() {
+	int chunkCount = static_cast<int>(job.chunkIndices.size());
+
+	if (job.settings.mapped) {
+		// Every chunk is split into slabs of SLAB_SIZE cube layers along z,
+		// so that the work is spread over all workers even when only a single chunk changed.
+		// First pass: count the triangles of every slab, which only needs the cube indices.
+		int slabsPerChunk = CHUNK_SIZE / SLAB_SIZE;
+		job.slabTriangles.resize(chunkCount * slabsPerChunk);
+		workers.parallelFor(chunkCount * slabsPerChunk, [this, slabsPerChunk](int slab) {
+			int snapshot = job.snapshots[slab / slabsPerChunk];
+			if (snapshot < 0) {
+				job.slabTriangles[slab] = 0;
+				return;
+			}
+			const Chunk& chunk = chunks[job.chunkIndices[slab / slabsPerChunk]];
+			glm::ivec3 origin = chunk.origin + glm::ivec3(0, 0, (slab % slabsPerChunk) * SLAB_SIZE);
+			glm::ivec3 end = chunkEnd(chunk);
+			end.z = glm::min(end.z, origin.z + SLAB_SIZE);
+			job.slabTriangles[slab] = countTriangles(job.densities[snapshot], job.settings.isoLevel, origin, end);
+		});
+
+		// A prefix sum over the slabs of each chunk gives where every slab writes its vertices and how big the chunk's range has to be
+		job.slabFirstVertex.resize(chunkCount * slabsPerChunk);
+		job.vertexCounts.assign(chunkCount, 0);
+		for (int i = 0; i < chunkCount; i++) {
+			for (int slab = i * slabsPerChunk; slab < (i + 1) * slabsPerChunk; slab++) {
+				job.slabFirstVertex[slab] = job.vertexCounts[i];
+				job.vertexCounts[i] += job.slabTriangles[slab] * 3;
+			}
+		}
+		return;
+	}
+
+	if (job.meshes.size() < job.chunkIndices.size()) {
+		job.meshes.resize(job.chunkIndices.size());
+	}
+
+	// Every chunk only reads the snapshot and writes to its own mesh data, so the workers can generate them independently
+	workers.parallelFor(chunkCount, [this](int i) {
+		ChunkMeshData& mesh = job.meshes[i];
+		mesh.vertices.clear();
+		mesh.indices.clear();
+		mesh.packedVertices.clear();
+		if (job.snapshots[i] < 0) return; // No surface in the voxels the chunk reads
+
+		const TerrainGrid::Snapshot& densities = job.densities[job.snapshots[i]];
+		const Chunk& chunk = chunks[job.chunkIndices[i]];
+		int level = job.levels[i];
+		if (level == 0) {
+			generateMesh(densities, job.settings, chunk.origin, chunkEnd(chunk), &mesh);
+		}
+		else if (densities.getRange(chunk.origin, chunkEnd(chunk)).crosses(job.settings.isoLevel)) {
+			// Mesh every stride-th voxel as a grid of its own, which has stride^3 times fewer cubes.
+			// The chunk origins are multiples of every stride, so neighbouring chunks of the same level sample the same voxels and line up.
+			int stride = 1 << level;
+			thread_local TerrainGrid::Snapshot coarse;
+			glm::ivec3 coarseOrigin = chunk.origin / stride;
+			// Rounded up, so that a chunk on the far border of the grid keeps the cubes past its last multiple of stride
+			glm::ivec3 coarseEnd = (chunkEnd(chunk) + glm::ivec3(stride - 1)) / stride;
+			coarse.downsample(densities, stride, coarseOrigin - glm::ivec3(1), coarseEnd + glm::ivec3(2));
+			generateMesh(coarse, job.settings, coarseOrigin, coarseEnd, &mesh);
+		}
+		if (job.simplify[i]) {
+			simplifyMesh(&mesh, job.settings, densities.scale);
+		}
+		if (level > 0) {
+			addSkirts(&mesh, job.settings.indexed, (1 << level) * densities.scale); // After simplifying, which keeps the open edges
+		}
+		if (job.settings.indexed && job.settings.optimizeVertexCache) {
+			optimizeMesh(&mesh); // Last, as the simplification and skirts change the triangles
+		}
+
+		if (job.settings.vertexFormat == VertexFormat::compact) {
+			glm::vec3 boxMin;
+			float boxSize;
+			getCompactBox(chunk.origin, level, densities.scale, boxMin, boxSize);
+			size_t vertexSize = getVertexSize(VertexFormat::compact);
+			size_t vertexCount = mesh.vertices.size() / 6;
+			mesh.packedVertices.resize(vertexCount * vertexSize);
+			for (size_t v = 0; v < vertexCount; v++) {
+				const float* vertex = &mesh.vertices[v * 6];
+				writeVertex(VertexFormat::compact, &mesh.packedVertices[v * vertexSize],
+					glm::vec3(vertex[0], vertex[1], vertex[2]), glm::vec3(vertex[3], vertex[4], vertex[5]), boxMin, boxSize);
+			}
+		}
+	});
+}
+
+void TerrainMesh::fillJob() {
+	// Second pass: every slab writes its triangles to its own part of the chunk's memory
+	int slabsPerChunk = CHUNK_SIZE / SLAB_SIZE;
+	int slabCount = static_cast<int>(job.chunkIndices.size()) * slabsPerChunk;
+	size_t vertexSize = getVertexSize(job.settings.vertexFormat);
+	workers.parallelFor(slabCount, [this, slabsPerChunk, vertexSize](int slab) {
+		unsigned char* mapping = job.mappings[slab / slabsPerChunk];
+		int snapshot = job.snapshots[slab / slabsPerChunk];
+		if (!mapping || snapshot < 0) return;
+
+		const Chunk& chunk = chunks[job.chunkIndices[slab / slabsPerChunk]];
+		glm::ivec3 origin = chunk.origin + glm::ivec3(0, 0, (slab % slabsPerChunk) * SLAB_SIZE);
+		glm::ivec3 end = chunkEnd(chunk);
+		end.z = glm::min(end.z, origin.z + SLAB_SIZE);
+		polygonize(job.densities[snapshot], job.settings, origin, end, nullptr, mapping + job.slabFirstVertex[slab] * vertexSize);
+	});
+}
+
+glm::ivec3 TerrainMesh::chunkEnd(const Chunk& chunk) const {
+	// The last chunk along an axis can be smaller than CHUNK_SIZE
+	return glm::min(chunk.origin + glm::ivec3(CHUNK_SIZE), chunkedDimensions - glm::ivec3(1));
+}
+
+void TerrainMesh::generateChunk(const Chunk& chunk, const MeshSettings& settings, ChunkMeshData* mesh) const {
+	mesh->vertices.clear();
+	mesh->indices.clear();
+	glm::ivec3 readMin, readMax;
+	getReadBox(chunk, 0, readMin, readMax);
+	if (!grid->getRange(readMin, readMax - glm::ivec3(1)).crosses(settings.isoLevel)) return;
+
+	// Only the chunk and its apron are copied, never the whole grid
+	thread_local TerrainGrid::Snapshot densities;
+	grid->copyRegion(readMin, readMax, densities);
+	generateMesh(densities, settings, chunk.origin, chunkEnd(chunk), mesh);
+}
+
+void TerrainMesh::getReadBox(const Chunk& chunk, int level, glm::ivec3& voxelMin, glm::ivec3& voxelMax) const {
+	int stride = 1 << level;
+	voxelMin = glm::max(chunk.origin - glm::ivec3(stride), glm::ivec3(0));
+	voxelMax = glm::min(chunkEnd(chunk) + glm::ivec3(stride + 1), chunkedDimensions);
+}
+
+int TerrainMesh::chooseLevel(const Chunk& chunk, glm::vec3 cameraPosition) const {
+	if (lodDistance <= 0.0f) return 0;
+
+	// The distance to the closest point of the chunk, so the camera is never close to a coarse chunk
+	glm::vec3 boxMin = glm::vec3(chunk.origin) * grid->getScale();
+	glm::vec3 boxMax = glm::vec3(chunkEnd(chunk)) * grid->getScale();
+	float distance = glm::length(cameraPosition - glm::clamp(cameraPosition, boxMin, boxMax));
+
+	int level = 0;
+	while (level < MAX_LEVEL && distance >= lodDistance * static_cast<float>(1 << level)) {
+		level++;
+	}
+	return level;
+}
+
+void TerrainMesh::getCompactBox(glm::ivec3 origin, int level, float scale, glm::vec3& boxMin, float& boxSize) {
+	int margin = COMPACT_MARGIN << level; // The margin is in cubes of the chunk's level of detail
+	boxMin = glm::vec3(origin - glm::ivec3(margin)) * scale;
+	boxSize = static_cast<float>(CHUNK_SIZE + 2 * margin) * scale;
+}
+
+void TerrainMesh::resizeChunks() {
+	// The running job refers to the old chunks
+	discardJob();
+	deleteChunks();
+
+	chunkedDimensions = grid->getDimensions();
+	glm::ivec3 cubeCounts = glm::max(chunkedDimensions - glm::ivec3(1), glm::ivec3(0));
+	chunkCounts = (cubeCounts + glm::ivec3(CHUNK_SIZE - 1)) / CHUNK_SIZE; // Round up, so that every cube is in a chunk
+
+	for (int cz = 0; cz < chunkCounts.z; cz++) {
+		for (int cy = 0; cy < chunkCounts.y; cy++) {
+			for (int cx = 0; cx < chunkCounts.x; cx++) {
+				Chunk chunk;
+				chunk.origin = glm::ivec3(cx, cy, cz) * CHUNK_SIZE;
+				chunk.vertexCount = 0;
+				chunk.indexCount = 0;
+				chunk.indexType = GL_UNSIGNED_SHORT;
+				chunk.vertexFormat = vertexFormat;
+				chunk.level = 0;
+				chunk.targetLevel = 0;
+				chunk.lastEdit = std::chrono::steady_clock::now();
+				chunk.simplify = false;
+
+				// Generate the VAO, the vertices and indices get a range of the buffer arena once the chunk has a mesh
+				glGenVertexArrays(1, &chunk.vao);
+				setVertexAttributes(chunk);
+
+				chunks.push_back(chunk);
+			}
+		}
+	}
+	chunkDirty.assign(chunks.size(), 0);
+
+}
+
+void TerrainMesh::setVertexAttributes(const Chunk& chunk) const {
+	// Chunks without a mesh are not drawn, and have no range to point to
+	if (chunk.vertices.page < 0) return;
+
+	// The chunk's ranges move around the buffer arena every time it is regenerated, so point the VAO at their current place
+	glBindVertexArray(chunk.vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers.GetBuffer(chunk.vertices));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.GetBuffer(chunk.indices));
+	const char* start = reinterpret_cast<const char*>(chunk.vertices.offset);
+
+	if (chunk.vertexFormat == VertexFormat::compact) {
+		// position at layout = 0, as fractions of the chunk size
+		glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, 8, start);
+		glEnableVertexAttribArray(0);
+
+		// normal at layout = 1, octahedral encoded
+		glVertexAttribPointer(1, 2, GL_BYTE, GL_TRUE, 8, start + 6);
+		glEnableVertexAttribArray(1);
+	}
+	else {
+		// position at layout = 0
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), start);
+		glEnableVertexAttribArray(0);
+
+		// normal at layout = 1
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), start + 3 * sizeof(float));
+		glEnableVertexAttribArray(1);
+	}
+
+	// Unbind the VAO before the buffers (so that the next code doesn't accidentically override it)
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-	// For each of the points, add them to a float array (by generating mesh)
-	std::vector<float> points;
+void TerrainMesh::writeVertex(VertexFormat format, unsigned char* out, glm::vec3 position, glm::vec3 normal, glm::vec3 boxMin, float boxSize) {
+	if (format == VertexFormat::full) {
+		float vertex[6] = { position.x, position.y, position.z, normal.x, normal.y, normal.z };
+		memcpy(out, vertex, sizeof(vertex));
+		return;
+	}
+
+	// Every vertex of a chunk lies within the chunk, or at most COMPACT_MARGIN cubes outside of it
+	glm::vec3 fraction = glm::clamp((position - boxMin) / boxSize, 0.0f, 1.0f);
+	unsigned short packedPosition[3];
+	for (int i = 0; i < 3; i++) {
+		packedPosition[i] = static_cast<unsigned short>(fraction[i] * 65535.0f + 0.5f);
+	}
+	memcpy(out, packedPosition, sizeof(packedPosition));
+
+	// Octahedral encoding: project the normal onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the upper half
+	signed char packedNormal[2] = { 0, 0 };
+	float length = fabs(normal.x) + fabs(normal.y) + fabs(normal.z);
+	if (length > 0.0f) {
+		glm::vec2 octahedral = glm::vec2(normal.x, normal.y) / length;
+		if (normal.z < 0.0f) {
+			octahedral = glm::vec2((1.0f - fabs(octahedral.y)) * (octahedral.x >= 0.0f ? 1.0f : -1.0f),
+				(1.0f - fabs(octahedral.x)) * (octahedral.y >= 0.0f ? 1.0f : -1.0f));
+		}
+		for (int i = 0; i < 2; i++) {
+			packedNormal[i] = static_cast<signed char>(glm::round(glm::clamp(octahedral[i], -1.0f, 1.0f) * 127.0f));
+		}
+	}
+	memcpy(out + 6, packedNormal, sizeof(packedNormal));
+}
+
+void TerrainMesh::deleteChunks() {
+	for (Chunk& chunk : chunks) {
+		buffers.Free(chunk.vertices);
+		buffers.Free(chunk.indices);
+		glDeleteVertexArrays(1, &chunk.vao);
+	}
+	chunks.clear();
+	dirtyChunks.clear(); // A job can leave some of them for the next one, which refer to the deleted chunks
+	chunkDirty.clear();
+	buffers.Retire();
+}
+
+size_t TerrainMesh::countTriangles(const TerrainGrid::Snapshot& densities, float isoLevel, glm::ivec3 origin, glm::ivec3 end) {
+	if (end.x <= origin.x || end.y <= origin.y || end.z <= origin.z) return 0;
+	thread_local CrossingBricks bricks;
+	if (!bricks.find(densities, isoLevel, origin, end)) return 0; // Entirely inside or outside of the terrain
+
+	// Only the corners are needed to count
+	thread_local DensityBlock block;
+	block.load(densities, origin, end, 0);
+	thread_local std::vector<unsigned char> cubeIndices;
+	cubeIndices.resize(end.x - origin.x);
+
+	size_t count = 0;
+	for (int z = origin.z; z < end.z; ++z) {
+		for (int y = origin.y; y < end.y; ++y) {
+			if (!classifyBrickRow(block, bricks, isoLevel, origin.x, end.x, y, z, cubeIndices.data()))
+				continue;
+
+			for (unsigned char cubeIndex : cubeIndices) {
+				count += triCountTable[cubeIndex];
+			}
+		}
+	}
+	return count;
+}
+
+void TerrainMesh::polygonize(const TerrainGrid::Snapshot& densities, const MeshSettings& settings, glm::ivec3 origin, glm::ivec3 end, ChunkMeshData* mesh, unsigned char* vertices) {
+	if (end.x <= origin.x || end.y <= origin.y || end.z <= origin.z) return;
+	thread_local CrossingBricks bricks;
+	if (!bricks.find(densities, settings.isoLevel, origin, end)) return; // Entirely inside or outside of the terrain
+
+	thread_local DensityBlock block;
+	block.load(densities, origin, end, 1);
+
+	// Gradients are computed a whole row of corners at a time, but only for the rows the surface passes by.
+	// Every row stores all x components, then all y components, then all z components.
+	thread_local std::vector<float> gradients;
+	thread_local std::vector<char> gradientRowDone;
+	if (settings.normalMode == NormalMode::gradient) {
+		gradients.resize(block.values.size() * 3);
+		gradientRowDone.assign(block.size.y * block.size.z, 0);
+	}
+	auto gradient = [&](glm::ivec3 p) {
+		int row = block.rowIndex(p.y, p.z);
+		int x = p.x - block.min.x;
+		float* rowGradients = &gradients[row * block.size.x * 3];
+		if (!gradientRowDone[row]) {
+			// Every corner of the box has its neighbours in the block, so skip the apron at both ends of the row
+			const float* rowDensities = block.row(block.min.x + 1, p.y, p.z);
+			const float* rowZMinus = block.row(block.min.x + 1, p.y, p.z - 1);
+			const float* rowZPlus = block.row(block.min.x + 1, p.y, p.z + 1);
+			MeshingKernels::gradientRow(rowDensities, rowDensities - block.size.x, rowDensities + block.size.x, rowZMinus, rowZPlus, block.size.x - 2,
+				rowGradients + 1, rowGradients + block.size.x + 1, rowGradients + 2 * block.size.x + 1);
+			gradientRowDone[row] = 1;
+		}
+		return glm::vec3(rowGradients[x], rowGradients[block.size.x + x], rowGradients[2 * block.size.x + x]);
+	};
+	// The density grows towards the inside of the terrain, so the surface normal points against the gradient
+	auto edgeNormal = [&](const Cube& cube, int c1, int c2) {
+		glm::vec3 g1 = gradient(glm::ivec3(cube.corners[c1]));
+		glm::vec3 g2 = gradient(glm::ivec3(cube.corners[c2]));
+		return -(g1 + (g2 - g1) * interpolationFactor(settings.isoLevel, cube.values[c1], cube.values[c2]));
+	};
+
+	// In indexed mode, remember the vertex generated on each edge of the box so that the other cubes around that edge reuse it.
+	// Every corner of the box owns the three edges starting at it along +x, +y and +z.
+	const int cornersPerAxis = CHUNK_SIZE + 1;
+	thread_local std::vector<int> edgeVertices;
+	if (settings.indexed) {
+		edgeVertices.assign(cornersPerAxis * cornersPerAxis * cornersPerAxis * 3, -1);
+	}
+
+	// The cubes are classified a row along x at a time, so that rows entirely inside or outside the surface are skipped at once
+	thread_local std::vector<unsigned char> cubeIndices;
+	cubeIndices.resize(end.x - origin.x);
+
+	// Without a vertex array, the vertices are written in order to the given memory (which has to fit all of them)
+	// This is only done at full resolution, in mapped mode.
+	glm::vec3 boxMin;
+	float boxSize;
+	getCompactBox(origin / CHUNK_SIZE * CHUNK_SIZE, 0, densities.scale, boxMin, boxSize);
+	size_t vertexSize = getVertexSize(settings.vertexFormat);
+	auto addVertex = [&](glm::vec3 v, glm::vec3 n) {
+		if (vertices) {
+			writeVertex(settings.vertexFormat, vertices, v, n, boxMin, boxSize);
+			vertices += vertexSize;
+		}
+		else {
+			mesh->vertices.push_back(v.x); mesh->vertices.push_back(v.y); mesh->vertices.push_back(v.z);
+			mesh->vertices.push_back(n.x); mesh->vertices.push_back(n.y); mesh->vertices.push_back(n.z);
+		}
+	};
 
-	//
-	// Generate mesh across entire density field
-	//
-	for (int x = 0; x < grid->getDimensions().x - 1; ++x) {
-		for (int y = 0; y < grid->getDimensions().y - 1; ++y) {
-			for (int z = 0; z < grid->getDimensions().z - 1; ++z) {
+	for (int z = origin.z; z < end.z; ++z) {
+		for (int y = origin.y; y < end.y; ++y) {
+			if (!classifyBrickRow(block, bricks, settings.isoLevel, origin.x, end.x, y, z, cubeIndices.data()))
+				continue;
+
+			for (int x = origin.x; x < end.x; ++x) {
+
+				// 
+				// Cube Index (configuration of which corners of a cube are inside or outside the surface i.e. tells us which triangles to generate for that cube)
+				//
+
+				int cubeIndex = cubeIndices[x - origin.x];
+
+				//
+				// Edge table check
+				//
+
+				// CASE 1: Cube entirely in/out of the surface
+				if (edgeTable[cubeIndex] == 0) {
+					continue;
+				}
 
 				//
 				// Create cube
@@ -392,76 +1767,94 @@ void TerrainMesh::updateVBO() {
 				cube.corners[6] = glm::vec3(x + 1, y + 1, z + 1);
 				cube.corners[7] = glm::vec3(x, y + 1, z + 1);
 
-				cube.values[0] = grid->get(glm::ivec3(x, y, z));
-				cube.values[1] = grid->get(glm::ivec3(x + 1, y, z));
-				cube.values[2] = grid->get(glm::ivec3(x + 1, y + 1, z));
-				cube.values[3] = grid->get(glm::ivec3(x, y + 1, z));
-				cube.values[4] = grid->get(glm::ivec3(x, y, z + 1));
-				cube.values[5] = grid->get(glm::ivec3(x + 1, y, z + 1));
-				cube.values[6] = grid->get(glm::ivec3(x + 1, y + 1, z + 1));
-				cube.values[7] = grid->get(glm::ivec3(x, y + 1, z + 1));
+				block.getCorners(x, y, z, cube.values);
 
-				// 
-				// determine Cube Index (configuration of which corners of a cube are inside or outside the surface i.e. tells us which triangles to generate for that cube)
-				//
+				// CASE 2: Cube intersects surface some where
+				if (settings.indexed) {
+					int cubeVertices[12]; // The index of the vertex on each edge of the cube that the surface intersects
 
-				int cubeIndex = 0; // binary: 00000000
-				if (cube.values[0] < isoLevel) cubeIndex |= 1; // binary: 00000001 i.e. sets bit 1
-				if (cube.values[1] < isoLevel) cubeIndex |= 2; // binary: 00000010 i.e. sets bit 2
-				if (cube.values[2] < isoLevel) cubeIndex |= 4; // binary: 00000100 i.e. sets bit 3
-				if (cube.values[3] < isoLevel) cubeIndex |= 8; // binary: 00001000 i.e. sets bit 4
-				if (cube.values[4] < isoLevel) cubeIndex |= 16; // binary: 00010000 i.e. sets bit 5
-				if (cube.values[5] < isoLevel) cubeIndex |= 32; // binary: 00100000 i.e. sets bit 6
-				if (cube.values[6] < isoLevel) cubeIndex |= 64; // binary: 01000000 i.e. sets bit 7
-				if (cube.values[7] < isoLevel) cubeIndex |= 128; // binary: 10000000 i.e. sets bit 8
+					for (int edge = 0; edge < 12; edge++) {
+						if (!(edgeTable[cubeIndex] & (1 << edge))) continue;
 
-				//
-				// Edge table check
-				//
+						int c1 = edgeCorners[edge][0];
+						int c2 = edgeCorners[edge][1];
+						glm::ivec3 local = glm::ivec3(x, y, z) - origin + cornerOffsets[c1];
+						int& vertex = edgeVertices[((local.z * cornersPerAxis + local.y) * cornersPerAxis + local.x) * 3 + edgeAxis[edge]];
 
-				// CASE 1: Cube entirely in/out of the surface
-				if (edgeTable[cubeIndex] == 0) {
+						if (vertex == -1) {
+							// First cube to reach this edge, so create its vertex.
+							// With face normals, the normal starts at zero to sum the triangle normals into.
+							glm::vec3 v = vertexInterpolation(settings.isoLevel, cube.corners[c1], cube.corners[c2], cube.values[c1], cube.values[c2]) * densities.scale;
+							glm::vec3 n = settings.normalMode == NormalMode::gradient ? edgeNormal(cube, c1, c2) : glm::vec3(0.0f);
+							vertex = static_cast<int>(mesh->vertices.size() / 6);
+							mesh->vertices.push_back(v.x); mesh->vertices.push_back(v.y); mesh->vertices.push_back(v.z);
+							mesh->vertices.push_back(n.x); mesh->vertices.push_back(n.y); mesh->vertices.push_back(n.z);
+						}
+						cubeVertices[edge] = vertex;
+					}
+
+					for (int i = 0; triTable[cubeIndex][i] != -1; i += 3) {
+						unsigned int i1 = cubeVertices[triTable[cubeIndex][i]];
+						unsigned int i2 = cubeVertices[triTable[cubeIndex][i + 1]];
+						unsigned int i3 = cubeVertices[triTable[cubeIndex][i + 2]];
+						mesh->indices.push_back(i1); mesh->indices.push_back(i2); mesh->indices.push_back(i3);
+						if (settings.normalMode == NormalMode::gradient) continue; // The vertices already have their normal
+
+						// Add the unnormalised normal to the vertices, so that bigger triangles weigh more in the vertex normal
+						std::vector<float>& points = mesh->vertices;
+						glm::vec3 v1 = glm::vec3(points[i1 * 6], points[i1 * 6 + 1], points[i1 * 6 + 2]);
+						glm::vec3 v2 = glm::vec3(points[i2 * 6], points[i2 * 6 + 1], points[i2 * 6 + 2]);
+						glm::vec3 v3 = glm::vec3(points[i3 * 6], points[i3 * 6 + 1], points[i3 * 6 + 2]);
+						glm::vec3 n = glm::cross(v2 - v1, v3 - v1);
+						for (unsigned int vertex : { i1, i2, i3 }) {
+							points[vertex * 6 + 3] += n.x; points[vertex * 6 + 4] += n.y; points[vertex * 6 + 5] += n.z;
+						}
+					}
 					continue;
 				}
 
-				// CASE 2: Cube intersects surface some where
-				glm::vec3 intersections[12];
-
 				if (edgeTable[cubeIndex] & 1) // if true, isosurface intersects edge 0
-					cube.intersections[0] = vertexInterpolation(cube.corners[0], cube.corners[1], cube.values[0], cube.values[1]); // perform interpolation to find where exactly it interesects
+					cube.intersections[0] = vertexInterpolation(settings.isoLevel, cube.corners[0], cube.corners[1], cube.values[0], cube.values[1]); // perform interpolation to find where exactly it interesects
 
 				if (edgeTable[cubeIndex] & 2) // if true, isosurface intersects edge 1
-					cube.intersections[1] = vertexInterpolation(cube.corners[1], cube.corners[2], cube.values[1], cube.values[2]); // perform interpolation to find where exactly it interesects
+					cube.intersections[1] = vertexInterpolation(settings.isoLevel, cube.corners[1], cube.corners[2], cube.values[1], cube.values[2]); // perform interpolation to find where exactly it interesects
 
 				if (edgeTable[cubeIndex] & 4) // ...
-					cube.intersections[2] = vertexInterpolation(cube.corners[2], cube.corners[3], cube.values[2], cube.values[3]);
+					cube.intersections[2] = vertexInterpolation(settings.isoLevel, cube.corners[2], cube.corners[3], cube.values[2], cube.values[3]);
 
 				if (edgeTable[cubeIndex] & 8)
-					cube.intersections[3] = vertexInterpolation(cube.corners[3], cube.corners[0], cube.values[3], cube.values[0]);
+					cube.intersections[3] = vertexInterpolation(settings.isoLevel, cube.corners[3], cube.corners[0], cube.values[3], cube.values[0]);
 
 				if (edgeTable[cubeIndex] & 16)
-					cube.intersections[4] = vertexInterpolation(cube.corners[4], cube.corners[5], cube.values[4], cube.values[5]);
+					cube.intersections[4] = vertexInterpolation(settings.isoLevel, cube.corners[4], cube.corners[5], cube.values[4], cube.values[5]);
 
 				if (edgeTable[cubeIndex] & 32)
-					cube.intersections[5] = vertexInterpolation(cube.corners[5], cube.corners[6], cube.values[5], cube.values[6]);
+					cube.intersections[5] = vertexInterpolation(settings.isoLevel, cube.corners[5], cube.corners[6], cube.values[5], cube.values[6]);
 
 				if (edgeTable[cubeIndex] & 64)
-					cube.intersections[6] = vertexInterpolation(cube.corners[6], cube.corners[7], cube.values[6], cube.values[7]);
+					cube.intersections[6] = vertexInterpolation(settings.isoLevel, cube.corners[6], cube.corners[7], cube.values[6], cube.values[7]);
 
 				if (edgeTable[cubeIndex] & 128)
-					cube.intersections[7] = vertexInterpolation(cube.corners[7], cube.corners[4], cube.values[7], cube.values[4]);
+					cube.intersections[7] = vertexInterpolation(settings.isoLevel, cube.corners[7], cube.corners[4], cube.values[7], cube.values[4]);
 
 				if (edgeTable[cubeIndex] & 256)
-					cube.intersections[8] = vertexInterpolation(cube.corners[4], cube.corners[0], cube.values[4], cube.values[0]); //! does order matter?
+					cube.intersections[8] = vertexInterpolation(settings.isoLevel, cube.corners[4], cube.corners[0], cube.values[4], cube.values[0]); //! does order matter?
 
 				if (edgeTable[cubeIndex] & 512)
-					cube.intersections[9] = vertexInterpolation(cube.corners[5], cube.corners[1], cube.values[5], cube.values[1]); //! does order matter?
+					cube.intersections[9] = vertexInterpolation(settings.isoLevel, cube.corners[5], cube.corners[1], cube.values[5], cube.values[1]); //! does order matter?
 
 				if (edgeTable[cubeIndex] & 1024)
-					cube.intersections[10] = vertexInterpolation(cube.corners[6], cube.corners[2], cube.values[6], cube.values[2]); //! does order matter?
+					cube.intersections[10] = vertexInterpolation(settings.isoLevel, cube.corners[6], cube.corners[2], cube.values[6], cube.values[2]); //! does order matter?
 
 				if (edgeTable[cubeIndex] & 2048)
-					cube.intersections[11] = vertexInterpolation(cube.corners[7], cube.corners[3], cube.values[7], cube.values[3]); //! does order matter?
+					cube.intersections[11] = vertexInterpolation(settings.isoLevel, cube.corners[7], cube.corners[3], cube.values[7], cube.values[3]); //! does order matter?
+
+				if (settings.normalMode == NormalMode::gradient) {
+					for (int edge = 0; edge < 12; edge++) {
+						if (edgeTable[cubeIndex] & (1 << edge))
+							cube.normals[edge] = edgeNormal(cube, edgeCorners[edge][0], edgeCorners[edge][1]);
+					}
+				}
 
 				//
 				// Create mesh
@@ -469,50 +1862,340 @@ void TerrainMesh::updateVBO() {
 				for (int i = 0; triTable[cubeIndex][i] != -1; i += 3) {
 
 					// Create vertices, scaled by the grid scale
-					glm::vec3 v1 = cube.intersections[triTable[cubeIndex][i]] * grid->getScale();
-					glm::vec3 v2 = cube.intersections[triTable[cubeIndex][i + 1]] * grid->getScale();
-					glm::vec3 v3 = cube.intersections[triTable[cubeIndex][i + 2]] * grid->getScale();
+					glm::vec3 v1 = cube.intersections[triTable[cubeIndex][i]] * densities.scale;
+					glm::vec3 v2 = cube.intersections[triTable[cubeIndex][i + 1]] * densities.scale;
+					glm::vec3 v3 = cube.intersections[triTable[cubeIndex][i + 2]] * densities.scale;
 
                     // calculate normal 
-                    glm::vec3 n = glm::normalize(glm::cross(v2 - v1, v3 - v1));
+                    glm::vec3 n1, n2, n3;
+                    if (settings.normalMode == NormalMode::gradient) {
+                        n1 = normalizeOrZero(cube.normals[triTable[cubeIndex][i]]);
+                        n2 = normalizeOrZero(cube.normals[triTable[cubeIndex][i + 1]]);
+                        n3 = normalizeOrZero(cube.normals[triTable[cubeIndex][i + 2]]);
+                    }
+                    else {
+                        n1 = n2 = n3 = glm::normalize(glm::cross(v2 - v1, v3 - v1));
+                    }
 
 					// Push into vertex buffer
-					points.push_back(v1.x); points.push_back(v1.y); points.push_back(v1.z);
-                    points.push_back(n.x); points.push_back(n.y); points.push_back(n.z);
+					addVertex(v1, n1);
+					addVertex(v2, n2);
+					addVertex(v3, n3);
 
-					points.push_back(v2.x); points.push_back(v2.y); points.push_back(v2.z);
-                    points.push_back(n.x); points.push_back(n.y); points.push_back(n.z);
+				}
+			}
+		}
+	}
+
+	if (settings.indexed) {
+		// Turn the summed triangle normals or the interpolated gradients into unit normals, all vertices in one go
+		std::vector<float>& points = mesh->vertices;
+		for (size_t i = 0; i < points.size(); i += 6) {
+			glm::vec3 n = normalizeOrZero(glm::vec3(points[i + 3], points[i + 4], points[i + 5]));
+			points[i + 3] = n.x; points[i + 4] = n.y; points[i + 5] = n.z;
+		}
+	}
+}
+
+void TerrainMesh::generateMesh(const TerrainGrid::Snapshot& densities, const MeshSettings& settings, glm::ivec3 origin, glm::ivec3 end, ChunkMeshData* mesh) {
+	if (settings.algorithm == Algorithm::surfaceNets) {
+		surfaceNets(densities, settings, origin, end, mesh);
+	}
+	else {
+		polygonize(densities, settings, origin, end, mesh, nullptr);
+	}
+}
+
+void TerrainMesh::addSkirts(ChunkMeshData* mesh, bool indexed, float length) {
+	std::vector<float>& points = mesh->vertices;
+	unsigned int vertexCount = static_cast<unsigned int>(points.size() / 6);
+	if (vertexCount == 0) return;
+
+	// Give every position an id. The indexed mesh already shares its vertices, the non-indexed one is welded by position.
+	thread_local std::vector<unsigned int> ids;
+	if (indexed) {
+		ids.resize(vertexCount);
+		for (unsigned int v = 0; v < vertexCount; v++) ids[v] = v;
+	}
+	else {
+		weldVertices(*mesh, length / 4096.0f, ids);
+	}
+
+	// An edge used by only one triangle is on the border of the mesh
+	struct Edge {
+		unsigned int low, high; // The ids of its ends
+		unsigned int from, to; // Its vertices, in the direction of its triangle
+	};
+	thread_local std::vector<Edge> edges;
+	edges.clear();
+	size_t cornerCount = indexed ? mesh->indices.size() : vertexCount;
+	for (size_t t = 0; t + 2 < cornerCount; t += 3) {
+		for (int i = 0; i < 3; i++) {
+			unsigned int from = indexed ? mesh->indices[t + i] : static_cast<unsigned int>(t + i);
+			unsigned int to = indexed ? mesh->indices[t + (i + 1) % 3] : static_cast<unsigned int>(t + (i + 1) % 3);
+			if (ids[from] == ids[to]) continue; // Degenerate
+			edges.push_back({ std::min(ids[from], ids[to]), std::max(ids[from], ids[to]), from, to });
+		}
+	}
+	std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) {
+		return a.low != b.low ? a.low < b.low : a.high < b.high;
+	});
 
-					points.push_back(v3.x); points.push_back(v3.y); points.push_back(v3.z);
-                    points.push_back(n.x); points.push_back(n.y); points.push_back(n.z);
+	// The skirt of an edge from a to b is the quad down to a' and b', wound like the triangle on the other side of the edge would be
+	thread_local std::vector<int> lowered; // The lowered copy of each vertex in the indexed mesh
+	if (indexed) lowered.assign(vertexCount, -1);
+	auto position = [&](unsigned int v) { return glm::vec3(points[v * 6], points[v * 6 + 1], points[v * 6 + 2]); };
+	auto normal = [&](unsigned int v) { return glm::vec3(points[v * 6 + 3], points[v * 6 + 4], points[v * 6 + 5]); };
+	auto pushVertex = [&](glm::vec3 p, glm::vec3 n) {
+		points.push_back(p.x); points.push_back(p.y); points.push_back(p.z);
+		points.push_back(n.x); points.push_back(n.y); points.push_back(n.z);
+	};
+	auto lower = [&](unsigned int v) {
+		glm::vec3 direction = normalizeOrZero(normal(v));
+		if (direction == glm::vec3(0.0f)) direction = glm::vec3(0.0f, 1.0f, 0.0f);
+		return position(v) - direction * length;
+	};
+	for (size_t e = 0; e < edges.size(); e++) {
+		bool shared = (e > 0 && edges[e - 1].low == edges[e].low && edges[e - 1].high == edges[e].high) ||
+			(e + 1 < edges.size() && edges[e + 1].low == edges[e].low && edges[e + 1].high == edges[e].high);
+		if (shared) continue;
 
+		unsigned int a = edges[e].from;
+		unsigned int b = edges[e].to;
+		if (indexed) {
+			for (unsigned int v : { a, b }) {
+				if (lowered[v] == -1) {
+					lowered[v] = static_cast<int>(points.size() / 6);
+					pushVertex(lower(v), normal(v));
 				}
 			}
+			unsigned int loweredA = static_cast<unsigned int>(lowered[a]);
+			unsigned int loweredB = static_cast<unsigned int>(lowered[b]);
+			mesh->indices.push_back(b); mesh->indices.push_back(a); mesh->indices.push_back(loweredA);
+			mesh->indices.push_back(b); mesh->indices.push_back(loweredA); mesh->indices.push_back(loweredB);
+		}
+		else {
+			glm::vec3 loweredA = lower(a);
+			glm::vec3 loweredB = lower(b);
+			glm::vec3 normalA = normal(a);
+			glm::vec3 normalB = normal(b);
+			pushVertex(position(b), normalB); pushVertex(position(a), normalA); pushVertex(loweredA, normalA);
+			pushVertex(position(b), normalB); pushVertex(loweredA, normalA); pushVertex(loweredB, normalB);
 		}
 	}
+}
 
-	vertexCount = points.size() / 3;
+void TerrainMesh::weldVertices(const ChunkMeshData& mesh, float quantum, std::vector<unsigned int>& ids) {
+	// Sort the rounded positions, so that equal ones end up next to each other.
+	// The rounding makes a vertex interpolated from both of the cubes around its edge still get one id.
+	struct WeldKey {
+		long long x, y, z;
+		unsigned int vertex;
+	};
+	thread_local std::vector<WeldKey> keys;
+	const std::vector<float>& points = mesh.vertices;
+	unsigned int vertexCount = static_cast<unsigned int>(points.size() / 6);
+	keys.resize(vertexCount);
+	ids.resize(vertexCount);
+	for (unsigned int v = 0; v < vertexCount; v++) {
+		keys[v] = { std::llround(points[v * 6] / quantum), std::llround(points[v * 6 + 1] / quantum), std::llround(points[v * 6 + 2] / quantum), v };
+	}
+	std::sort(keys.begin(), keys.end(), [](const WeldKey& a, const WeldKey& b) {
+		if (a.x != b.x) return a.x < b.x;
+		if (a.y != b.y) return a.y < b.y;
+		return a.z < b.z;
+	});
+	for (unsigned int k = 0; k < vertexCount; k++) {
+		bool same = k > 0 && keys[k].x == keys[k - 1].x && keys[k].y == keys[k - 1].y && keys[k].z == keys[k - 1].z;
+		ids[keys[k].vertex] = same ? ids[keys[k - 1].vertex] : keys[k].vertex;
+	}
+}
 
-     // Generate the VAO and VBO
-	glGenVertexArrays(1, &vao);
-	glGenBuffers(1, &vbo);
+float TerrainMesh::simplifyMesh(ChunkMeshData* mesh, const MeshSettings& settings, float scale) {
+	thread_local MeshSimplifier simplifier;
+	if (settings.indexed) {
+		return simplifier.simplify(mesh->vertices, mesh->indices, settings.simplificationError);
+	}
 
-	// Bind the right buffers
-	glBindVertexArray(vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	// Add the data to the buffers
-	glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(float), points.data(), GL_STATIC_DRAW);
+	// The simplifier needs the shared vertices, so weld the non-indexed mesh into an indexed one and split it up again afterwards
+	thread_local std::vector<unsigned int> ids;
+	thread_local std::vector<float> welded;
+	thread_local std::vector<unsigned int> weldedIndices;
+	thread_local std::vector<unsigned int> weldedIndex; // The welded vertex of every id
+	std::vector<float>& points = mesh->vertices;
+	weldVertices(*mesh, scale / 4096.0f, ids);
+	welded.clear();
+	weldedIndices.clear();
+	weldedIndex.assign(ids.size(), ~0u);
+	for (size_t v = 0; v < ids.size(); v++) {
+		unsigned int& index = weldedIndex[ids[v]];
+		if (index == ~0u) {
+			index = static_cast<unsigned int>(welded.size() / 6);
+			welded.insert(welded.end(), &points[v * 6], &points[v * 6] + 6);
+		}
+		weldedIndices.push_back(index);
+	}
 
-    // position at layout = 0
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
+	float error = simplifier.simplify(welded, weldedIndices, settings.simplificationError);
 
-    // normal at layout = 1
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	points.clear();
+	for (size_t i = 0; i + 2 < weldedIndices.size(); i += 3) {
+		glm::vec3 corners[3];
+		for (int k = 0; k < 3; k++) {
+			const float* v = &welded[weldedIndices[i + k] * 6];
+			corners[k] = glm::vec3(v[0], v[1], v[2]);
+		}
+		glm::vec3 faceNormal = normalizeOrZero(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+		for (int k = 0; k < 3; k++) {
+			const float* v = &welded[weldedIndices[i + k] * 6];
+			glm::vec3 n = settings.normalMode == NormalMode::face ? faceNormal : glm::vec3(v[3], v[4], v[5]);
+			points.push_back(v[0]); points.push_back(v[1]); points.push_back(v[2]);
+			points.push_back(n.x); points.push_back(n.y); points.push_back(n.z);
+		}
+	}
+	return error;
+}
 
-	// Unbind the buffers (so that the next code doesn't accidentically override it)
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+void TerrainMesh::optimizeMesh(ChunkMeshData* mesh) {
+	thread_local MeshOptimizer optimizer;
+	optimizer.optimizeVertexCache(mesh->indices, mesh->vertices.size() / 6);
+	optimizer.optimizeVertexFetch(mesh->vertices, mesh->indices);
+}
+
+void TerrainMesh::surfaceNets(const TerrainGrid::Snapshot& densities, const MeshSettings& settings, glm::ivec3 origin, glm::ivec3 end, ChunkMeshData* mesh) {
+	if (end.x <= origin.x || end.y <= origin.y || end.z <= origin.z) return;
+	// Every edge the surface crosses lies in a cube of the chunk that the surface passes through
+	thread_local CrossingBricks bricks;
+	if (!bricks.find(densities, settings.isoLevel, origin, end)) return;
+
+	// The corners of the cubes one before the chunk are needed for their vertices
+	thread_local DensityBlock block;
+	block.load(densities, origin, end, 1);
+
+	// The vertex of every cube [origin - 1, end), created when the first quad uses it
+	glm::ivec3 cubeMin = origin - glm::ivec3(1);
+	glm::ivec3 cubeCounts = end - cubeMin;
+	thread_local std::vector<int> cubeVertices;
+	cubeVertices.assign(cubeCounts.x * cubeCounts.y * cubeCounts.z, -1);
+
+	auto cubeVertex = [&](glm::ivec3 cube) {
+		glm::ivec3 local = cube - cubeMin;
+		int& vertex = cubeVertices[(local.z * cubeCounts.y + local.y) * cubeCounts.x + local.x];
+		if (vertex != -1) return vertex;
+
+		float values[8];
+		block.getCorners(cube.x, cube.y, cube.z, values);
+
+		// The vertex lies at the average of the points where the surface crosses the edges of the cube
+		glm::vec3 sum(0.0f);
+		int crossings = 0;
+		for (int edge = 0; edge < 12; edge++) {
+			int c1 = edgeCorners[edge][0];
+			int c2 = edgeCorners[edge][1];
+			if ((values[c1] < settings.isoLevel) == (values[c2] < settings.isoLevel)) continue;
 
+			sum += glm::vec3(cornerOffsets[c1]) + glm::vec3(cornerOffsets[c2] - cornerOffsets[c1]) * interpolationFactor(settings.isoLevel, values[c1], values[c2]);
+			crossings++;
+		}
+		glm::vec3 position = crossings > 0 ? sum / float(crossings) : glm::vec3(0.5f);
+
+		// The gradient of the trilinear interpolation of the corners at the vertex.
+		// With face normals, the normal starts at zero to sum the triangle normals into.
+		glm::vec3 n(0.0f);
+		if (settings.normalMode == NormalMode::gradient) {
+			glm::vec3 weight = position;
+			auto lerp = [](float a, float b, float t) { return a + (b - a) * t; };
+			// Corners 0, 1, 2, 3 are at z = 0 and 4, 5, 6, 7 at z = 1, see cornerOffsets
+			float dx0 = lerp(values[1] - values[0], values[2] - values[3], weight.y);
+			float dx1 = lerp(values[5] - values[4], values[6] - values[7], weight.y);
+			float dy0 = lerp(values[3] - values[0], values[2] - values[1], weight.x);
+			float dy1 = lerp(values[7] - values[4], values[6] - values[5], weight.x);
+			float dz0 = lerp(values[4] - values[0], values[5] - values[1], weight.x);
+			float dz1 = lerp(values[7] - values[3], values[6] - values[2], weight.x);
+			// The density grows towards the inside of the terrain, so the surface normal points against the gradient
+			n = -glm::vec3(lerp(dx0, dx1, weight.z), lerp(dy0, dy1, weight.z), lerp(dz0, dz1, weight.y));
+		}
+
+		glm::vec3 v = (glm::vec3(cube) + position) * densities.scale;
+		vertex = static_cast<int>(mesh->vertices.size() / 6);
+		mesh->vertices.push_back(v.x); mesh->vertices.push_back(v.y); mesh->vertices.push_back(v.z);
+		mesh->vertices.push_back(n.x); mesh->vertices.push_back(n.y); mesh->vertices.push_back(n.z);
+		return vertex;
+	};
+
+	auto addTriangle = [&](int i1, int i2, int i3) {
+		mesh->indices.push_back(i1); mesh->indices.push_back(i2); mesh->indices.push_back(i3);
+		if (settings.normalMode == NormalMode::gradient) return; // The vertices already have their normal
+
+		// Add the unnormalised normal to the vertices, so that bigger triangles weigh more in the vertex normal
+		std::vector<float>& points = mesh->vertices;
+		glm::vec3 v1 = glm::vec3(points[i1 * 6], points[i1 * 6 + 1], points[i1 * 6 + 2]);
+		glm::vec3 v2 = glm::vec3(points[i2 * 6], points[i2 * 6 + 1], points[i2 * 6 + 2]);
+		glm::vec3 v3 = glm::vec3(points[i3 * 6], points[i3 * 6 + 1], points[i3 * 6 + 2]);
+		glm::vec3 n = glm::cross(v2 - v1, v3 - v1);
+		for (int vertex : { i1, i2, i3 }) {
+			points[vertex * 6 + 3] += n.x; points[vertex * 6 + 4] += n.y; points[vertex * 6 + 5] += n.z;
+		}
+	};
+
+	// The corner at the end of the edge starting at corner 0 along x, y and z, and the axes themselves
+	static const int axisCorners[3] = { 1, 3, 4 };
+	static const glm::ivec3 axes[3] = { glm::ivec3(1, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(0, 0, 1) };
+
+	thread_local std::vector<unsigned char> cubeIndices;
+	cubeIndices.resize(end.x - origin.x);
+
+	for (int z = origin.z; z < end.z; ++z) {
+		for (int y = origin.y; y < end.y; ++y) {
+			if (!classifyBrickRow(block, bricks, settings.isoLevel, origin.x, end.x, y, z, cubeIndices.data()))
+				continue;
+
+			for (int x = origin.x; x < end.x; ++x) {
+				int cubeIndex = cubeIndices[x - origin.x];
+				if (cubeIndex == 0 || cubeIndex == 255) continue;
+
+				// Every cube owns the three edges starting at its first corner. The four cubes around an edge the surface crosses are joined by a quad.
+				glm::ivec3 corner(x, y, z);
+				bool firstOutside = cubeIndex & 1; // Whether the first corner is outside of the terrain
+				for (int axis = 0; axis < 3; axis++) {
+					if (firstOutside == ((cubeIndex & (1 << axisCorners[axis])) != 0)) continue;
+
+					int axisB = (axis + 1) % 3;
+					int axisC = (axis + 2) % 3;
+					if (corner[axisB] == 0 || corner[axisC] == 0) continue; // The edge is on the border of the grid, so there are no cubes on one side of it
+
+					// Going around the edge from b to c faces the quad along the axis.
+					// The normal has to point out of the terrain, so turn it around if the first corner is the one outside of it.
+					glm::ivec3 b = axes[axisB];
+					glm::ivec3 c = axes[axisC];
+					int v00 = cubeVertex(corner - b - c);
+					int v10 = cubeVertex(corner - c);
+					int v11 = cubeVertex(corner);
+					int v01 = cubeVertex(corner - b);
+					if (firstOutside) {
+						std::swap(v10, v01);
+					}
+
+					// Split the quad along its shorter diagonal, which gives the better shaped triangles
+					const std::vector<float>& points = mesh->vertices;
+					auto position = [&](int vertex) { return glm::vec3(points[vertex * 6], points[vertex * 6 + 1], points[vertex * 6 + 2]); };
+					if (glm::length(position(v00) - position(v11)) <= glm::length(position(v10) - position(v01))) {
+						addTriangle(v00, v10, v11);
+						addTriangle(v00, v11, v01);
+					}
+					else {
+						addTriangle(v00, v10, v01);
+						addTriangle(v10, v11, v01);
+					}
+				}
+			}
+		}
+	}
+
+	// Turn the summed triangle normals or the interpolated gradients into unit normals
+	std::vector<float>& points = mesh->vertices;
+	for (size_t i = 0; i < points.size(); i += 6) {
+		glm::vec3 n = normalizeOrZero(glm::vec3(points[i + 3], points[i + 4], points[i + 5]));
+		points[i + 3] = n.x; points[i + 4] = n.y; points[i + 5] = n.z;
+	}
 }
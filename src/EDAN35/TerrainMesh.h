@@ -1,32 +1,310 @@
 #pragma once
 
 #include "TerrainGrid.h"
+#include "WorkerPool.h"
+#include "MeshingKernels.h"
+#include "ComputeMesher.h"
+#include "MeshExporter.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "core/BufferArena.hpp"
 
 #include <glm/glm.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 
 /// Renderer class that generates and draws the marching cubes mesh for a given TerrainGrid.
-/// 
+///
+/// The cubes are split into chunks of CHUNK_SIZE^3 cubes that each have their own VAO and VBO,
+/// so that a change to the grid only has to regenerate the chunks around the changed voxels.
+///
+/// Chunks far from the camera can be meshed at a lower level of detail, from every 2nd, 4th or 8th voxel of the grid.
+/// Where chunks of different levels meet, skirts hanging from the edges of the coarser chunks hide the cracks between them.
+///
+/// Chunks that haven't been edited for a while are simplified with quadric edge collapses, down to a maximum error,
+/// until they are edited again. The borders of the chunks are kept, so they still meet their neighbours.
+///
+/// Indexed chunks have their triangles and vertices reordered for the GPU's vertex cache, and the chunks are drawn front to back,
+/// so that the closer chunks fill the depth buffer first and hide the fragments of the ones behind them.
+///
+/// The chunks are regenerated on a background meshing thread, from a snapshot of the changed part of the grid,
+/// while draw() keeps drawing their previous mesh. draw() swaps the new meshes in once they are done,
+/// and starts the next job with the chunks that changed in the meantime.
+///
 class TerrainMesh {
 public:
-	TerrainMesh(TerrainGrid* grid);
+	// How the surface is extracted from the grid
+	enum class Algorithm : unsigned int {
+		marchingCubes, // Up to five triangles per cube, with the vertices on the cube edges
+		surfaceNets // One vertex per cube the surface passes through, at the average of its edge intersections, joined by a quad across every intersected edge
+	};
+
+	// The size of the whole mesh generated by an algorithm, see benchmarkMeshers()
+	struct MesherBenchmark {
+		Algorithm algorithm;
+		size_t triangles;
+		size_t vertices;
+		size_t bytes; // Of the vertices and indices, in the current vertex format
+		double milliseconds;
+	};
+
+	// The size of the whole mesh simplified to a maximum error, see benchmarkSimplification()
+	struct SimplificationBenchmark {
+		float targetError;
+		size_t trianglesBefore;
+		size_t trianglesAfter;
+		float error; // The largest quadric error of the collapses that were made
+		double milliseconds; // Of the simplification alone
+	};
+
+	// How well the indexed mesh of the whole grid uses the vertex cache, see benchmarkVertexCache()
+	struct VertexCacheBenchmark {
+		bool optimized; // Whether the triangles were in the optimised order, or in the order they were generated in
+		double acmr; // Transformed vertices per triangle
+		double atvr; // Transformed vertices per vertex
+		double milliseconds; // Of the optimisation alone
+	};
+
+	// How the vertex normals are computed
+	enum class NormalMode : unsigned int {
+		face, // The normal of the triangle (averaged over the triangles around a vertex in indexed mode)
+		gradient // The density gradient of the grid, interpolated along the edge of the vertex
+	};
+
+	// How the vertices are stored in the vertex buffers, decoded by Triplanar.vert
+	enum class VertexFormat : unsigned int {
+		full, // 24 bytes: the position and normal as six floats
+		compact // 8 bytes: the position relative to the chunk as three 16 bit fixed point values, and an octahedral encoded normal in two bytes
+	};
+
+	// The compute programs are only needed for compute meshing, see setComputeMeshing()
+	TerrainMesh(TerrainGrid* grid, const ComputeMesher::Programs* computePrograms = nullptr);
+	~TerrainMesh();
 
 	void draw(FPSCameraf* camera, GLuint shader, float max_y);
 	void setIsoLevel(float iso);
 	float getIsoLevel() const;
+	// Surface nets always shares its vertices, so it is always indexed and never mapped
+	void setAlgorithm(Algorithm algorithm);
+	Algorithm getAlgorithm() const;
+	void setWorkerCount(int count); // Sets the amount of threads used to generate the mesh
+	int getWorkerCount() const;
+	// In indexed mode, cubes sharing an edge share the vertex on it and the chunks are drawn with glDrawElements.
+	// The vertex normals are then the average of the normals of the triangles around them.
+	void setIndexed(bool indexed);
+	bool getIndexed() const;
+	void setNormalMode(NormalMode mode);
+	NormalMode getNormalMode() const;
+	// In mapped mode, the triangles are counted first so that the mesh can be written straight into exactly sized ranges of the persistently mapped buffer arena.
+	// Only used for the non-indexed mesh without level of detail, the others are always generated into memory first.
+	void setMappedUpload(bool mapped);
+	bool getMappedUpload() const;
+	// Chunks further than this from the camera use the next level of detail, with every doubling of the distance halving the resolution once more.
+	// Each ring around the camera then has about as many triangles, so their count only grows with the logarithm of the view distance. 0 turns it off.
+	void setLodDistance(float distance);
+	float getLodDistance() const;
+	// Chunks that weren't edited for the simplification delay (in seconds) are regenerated and simplified on the meshing thread,
+	// collapsing edges as long as they move the surface less than the simplification error (in world units). An error of 0 turns it off.
+	void setSimplificationError(float error);
+	float getSimplificationError() const;
+	void setSimplificationDelay(float seconds);
+	float getSimplificationDelay() const;
+	// Reorders the triangles of the indexed chunks for the vertex cache, and their vertices in the order the triangles use them
+	void setOptimizeVertexCache(bool optimize);
+	bool getOptimizeVertexCache() const;
+	void setVertexFormat(VertexFormat format);
+	VertexFormat getVertexFormat() const;
+	size_t getVertexSize() const; // The amount of bytes per vertex in the current vertex format
+	// With compute meshing, the whole mesh is generated on the GPU by a ComputeMesher instead of the chunks on the CPU.
+	// It always generates a non-indexed marching cubes mesh at full resolution in the full vertex format,
+	// so the algorithm, indexed, mapped, level of detail and vertex format settings don't apply to it.
+	void setComputeMeshing(bool compute);
+	bool getComputeMeshing() const;
+	bool isComputeMeshingAvailable() const; // Needs OpenGL 4.3 and the compute programs
+	void finishMeshing(); // Blocks until every change so far is meshed and swapped in, instead of letting draw() pick them up
+	// Classifies every cube of the grid with each instruction set the CPU supports, and returns how many cubes per second each of them managed
+	std::vector<std::pair<MeshingKernels::Instructions, double>> benchmarkClassification() const;
+	// Generates the mesh of the whole grid with each algorithm and the current settings, without drawing it
+	std::vector<MesherBenchmark> benchmarkMeshers();
+	// Meshes the whole grid with the current settings and simplifies it to a range of errors, to compare the triangle reduction against the error
+	std::vector<SimplificationBenchmark> benchmarkSimplification();
+	// Meshes the whole grid indexed, and simulates the vertex cache with the triangles in their generated and in their optimised order
+	std::vector<VertexCacheBenchmark> benchmarkVertexCache();
+	// Writes the full resolution surface of the whole grid to a file, with the current algorithm, iso level and normals.
+	// The chunks are meshed a batch at a time and streamed to the file, so only one batch of meshes is ever in memory.
+	// Every chunk has its own vertices, so the vertices on the borders between chunks are written once for each of them.
+	bool exportMesh(const std::string& path, MeshExporter::Format format);
+
+	// Meshes the cubes [origin, end) of a snapshot on the calling thread, without any OpenGL, for benchmarks and tools.
+	// The cubes have to fit in a chunk. vertices gets six floats (position and normal) per vertex, and indices three vertices per triangle in indexed mode.
+	static void generateRegion(const TerrainGrid::Snapshot& densities, float isoLevel, Algorithm algorithm, bool indexed, NormalMode normalMode,
+		glm::ivec3 origin, glm::ivec3 end, std::vector<float>& vertices, std::vector<unsigned int>& indices);
+
+	static const int CHUNK_SIZE = 32; // The amount of cubes along each axis of a chunk
+	static const int SLAB_SIZE = 8; // The amount of cube layers along z that one job generates in mapped mode
+	static const int MAX_LEVEL = 3; // The coarsest level of detail, which uses every 8th voxel
+	static const int MAX_JOB_VOXELS = 1 << 22; // The most voxels one meshing job copies from the grid, the other dirty chunks wait for the next job
+	static const int MAX_GROUP_CHUNKS = 4; // The most neighbouring chunks along x that share one snapshot in a meshing job
 
 private:
-	GLuint vbo, vao;
-	void updateVBO();
+	// The settings a mesh is generated with, copied when a meshing job starts so that changing them doesn't affect a running job
+	struct MeshSettings {
+		float isoLevel;
+		Algorithm algorithm;
+		bool indexed;
+		NormalMode normalMode;
+		VertexFormat vertexFormat;
+		bool mapped; // Count, then write into mapped memory (mappedUpload without indexed)
+		float simplificationError; // For the chunks that are simplified
+		bool optimizeVertexCache; // Only for indexed meshes
+	};
+
+	struct Chunk {
+		glm::ivec3 origin; // The first cube of the chunk
+		GLuint vao;
+		BufferArena::Allocation vertices; // The chunk's range of the buffer arena holding its vertices
+		BufferArena::Allocation indices; // Only used in indexed mode
+		size_t vertexCount;
+		size_t indexCount; // Only used in indexed mode
+		GLenum indexType; // GL_UNSIGNED_SHORT when all vertices fit in 16 bits, GL_UNSIGNED_INT otherwise
+		VertexFormat vertexFormat; // The format of the vertices, which can lag behind the current one until the chunk is regenerated
+		int level; // The level of detail of the mesh, which uses every 2^level-th voxel
+		int targetLevel; // The level of detail for the current camera distance, the chunk is regenerated when it changes
+		std::chrono::steady_clock::time_point lastEdit; // When the grid last changed around the chunk
+		bool simplify; // Whether the chunk was idle for long enough to be simplified
+	};
+
+	struct ChunkMeshData {
+		std::vector<float> vertices; // The position and normal of every vertex
+		std::vector<unsigned char> packedVertices; // The vertices in the compact vertex format, only used with VertexFormat::compact
+		std::vector<unsigned int> indices; // Three vertices per triangle, only used in indexed mode
+	};
+
+	// Who works on the current meshing job. The render thread and the meshing thread take turns,
+	// and only the one whose turn it is touches the job.
+	enum class JobStage : unsigned int {
+		idle, // Render thread: no job, draw() starts one when chunks changed
+		generating, // Meshing thread: generating the meshes, or counting the triangles in mapped mode
+		allocating, // Render thread: giving every chunk a range of the buffer arena to write its mapped mesh to
+		filling, // Meshing thread: writing the mapped meshes
+		done // Render thread: uploading the meshes and swapping them in
+	};
+
+	// The regeneration of some chunks, from snapshots of the grid around them
+	struct MeshingJob {
+		std::vector<int> chunkIndices;
+		std::vector<int> levels; // The level of detail of each chunk
+		std::vector<char> simplify; // Whether to simplify each chunk
+		std::vector<int> snapshots; // The snapshot each chunk reads, -1 for the chunks without any surface
+		std::vector<TerrainGrid::Snapshot> densities; // The voxels read by a few neighbouring chunks each, kept around to reuse their memory
+		MeshSettings settings;
+
+		std::vector<ChunkMeshData> meshes; // The mesh generated for each chunk, kept around to reuse their memory
+		std::vector<size_t> slabTriangles; // Mapped mode: the amount of triangles in each slab of the chunks
+		std::vector<size_t> slabFirstVertex; // Mapped mode: where in its chunk's vertex buffer each slab starts
+		std::vector<size_t> vertexCounts; // Mapped mode: the amount of vertices of each chunk
+		std::vector<BufferArena::Allocation> ranges; // Mapped mode: the new range of each chunk, swapped in when the job is done
+		std::vector<unsigned char*> mappings; // Mapped mode: where each chunk writes its vertices
+		std::vector<unsigned char> staging; // Mapped mode: where the vertices are written when the buffer arena is not persistently mapped
+	};
+
+	void updateVBO(); // Regenerates the mesh of every chunk
+	void updateRegion(glm::ivec3 voxelMin, glm::ivec3 voxelMax); // Regenerates the chunks that use any of the voxels [voxelMin, voxelMax)
+	void markChunkDirty(int chunkIndex); // Regenerates the chunk in the next meshing job
+	void resizeChunks(); // Recreates the chunks to cover the current grid dimensions
+	void setVertexAttributes(const Chunk& chunk) const; // Points the chunk's VAO at its ranges of the buffer arena, in its vertex format
+	void deleteChunks();
+	glm::ivec3 chunkEnd(const Chunk& chunk) const; // One past the last cube of the chunk
+	// The voxels [voxelMin, voxelMax) the chunk reads at the given level of detail, including the apron of one stride around it for the gradients
+	void getReadBox(const Chunk& chunk, int level, glm::ivec3& voxelMin, glm::ivec3& voxelMax) const;
+	int chooseLevel(const Chunk& chunk, glm::vec3 cameraPosition) const; // The level of detail for the distance of the chunk to the camera
+	// Compact positions cover this many cubes (of the chunk's level of detail) around the chunk as well.
+	// The surface nets vertices of a chunk reach one cube past its origin, and its skirts one more.
+	static const int COMPACT_MARGIN = 2;
+	// The box the compact positions of a chunk are stored in, as fractions of its size
+	static void getCompactBox(glm::ivec3 origin, int level, float scale, glm::vec3& boxMin, float& boxSize);
+	MeshSettings getSettings() const;
+	// Meshes the full level of detail of the chunk on the calling thread, from a copy of only the voxels it reads, for the benchmarks
+	void generateChunk(const Chunk& chunk, const MeshSettings& settings, ChunkMeshData* mesh) const;
+
+	// Render thread side of the meshing jobs
+	void updateMeshing(); // Moves the current job along if it is the render thread's turn, and starts a new one if there is none
+	void startJob(); // Snapshots the first dirty chunks, up to MAX_JOB_VOXELS, and hands them to the meshing thread
+	void allocateJobRanges(); // Mapped mode: allocates the counted vertices of every chunk
+	void finishJob(); // Uploads the new meshes and swaps them in
+	void discardJob(); // Waits for the meshing thread and throws its work away, before the chunks are recreated
+	void waitForMeshingThread(); // Blocks until it is not the meshing thread's turn
+
+	// Meshing thread side of the meshing jobs
+	void meshingLoop();
+	void generateJob(); // Generates the meshes into memory, or counts the triangles in mapped mode
+	void fillJob(); // Mapped mode: generates the meshes into the allocated ranges
+
+	// The amount of triangles polygonize() generates for the same cubes
+	static size_t countTriangles(const TerrainGrid::Snapshot& densities, float isoLevel, glm::ivec3 origin, glm::ivec3 end);
+	// Generates the mesh of the cubes [origin, end) into mesh with the settings' algorithm
+	static void generateMesh(const TerrainGrid::Snapshot& densities, const MeshSettings& settings, glm::ivec3 origin, glm::ivec3 end, ChunkMeshData* mesh);
+	// Generates the surface nets mesh of the cubes [origin, end), which have to fit in a chunk.
+	// Every chunk generates the quads of the grid edges starting at its corners, which uses the vertices of the cubes one before the chunk as well.
+	static void surfaceNets(const TerrainGrid::Snapshot& densities, const MeshSettings& settings, glm::ivec3 origin, glm::ivec3 end, ChunkMeshData* mesh);
+	// Generates the marching cubes triangles of the cubes [origin, end), which have to fit in a chunk.
+	// The vertices are written to vertices in the settings' vertex format if it isn't null (non-indexed only), and added to mesh as floats otherwise.
+	static void polygonize(const TerrainGrid::Snapshot& densities, const MeshSettings& settings, glm::ivec3 origin, glm::ivec3 end, ChunkMeshData* mesh, unsigned char* vertices);
+	// Adds a skirt to every open edge of the mesh: a quad hanging from the edge into the terrain, against the normals of its vertices
+	static void addSkirts(ChunkMeshData* mesh, bool indexed, float length);
+	// Simplifies the mesh of a grid with the given scale to the settings' simplification error, and returns the error it reached
+	static float simplifyMesh(ChunkMeshData* mesh, const MeshSettings& settings, float scale);
+	// Reorders an indexed mesh for the vertex cache and the vertex fetches
+	static void optimizeMesh(ChunkMeshData* mesh);
+	// Gives every vertex the id of the first vertex at the same position (rounded to quantum), to find the shared vertices of a non-indexed mesh
+	static void weldVertices(const ChunkMeshData& mesh, float quantum, std::vector<unsigned int>& ids);
+	// Stores a vertex in the given vertex format, compact positions relative to the box from getCompactBox()
+	static void writeVertex(VertexFormat format, unsigned char* out, glm::vec3 position, glm::vec3 normal, glm::vec3 boxMin, float boxSize);
+	static size_t getVertexSize(VertexFormat format);
 
 	TerrainGrid* grid;
-	size_t vertexCount;
 	float isoLevel;
+	Algorithm algorithm;
+	bool indexed;
+	NormalMode normalMode;
+	bool mappedUpload;
+	VertexFormat vertexFormat;
+	float lodDistance;
+	float simplificationError;
+	float simplificationDelay;
+	bool optimizeVertexCache;
+	bool computeMeshing;
+
+	std::vector<Chunk> chunks;
+	glm::ivec3 chunkCounts; // The amount of chunks along each axis
+	glm::ivec3 chunkedDimensions; // The grid dimensions the chunks were created for
+	std::vector<int> dirtyChunks; // The chunks to regenerate in the next job
+	std::vector<char> chunkDirty; // Whether each chunk is in dirtyChunks
+	std::vector<std::pair<float, int>> drawOrder; // The distance to the camera and index of every chunk with a mesh, sorted front to back
+
+	WorkerPool workers; // Threads that generate the mesh of a job, one chunk (or slab) at a time
+	MeshingJob job;
+	std::thread meshingThread;
+	std::mutex meshingMutex; // Guards jobStage and stopMeshing
+	std::condition_variable meshingCondition; // Signals changes of jobStage
+	JobStage jobStage;
+	bool stopMeshing;
+	std::vector<unsigned short> shortIndices; // Staging memory to upload indices as 16 bits
+
+	BufferArena buffers; // Holds the vertices and indices of all chunks
+	ComputeMesher computeMesher; // Generates and holds the mesh in compute meshing mode, instead of the chunks
 
 	// Marching cube helpers
 	static int edgeTable[256];
 	static int triTable[256][16];
-	glm::vec3 vertexInterpolation(glm::vec3& p1, glm::vec3& p2, float valp1, float valp2);
+	static int triCountTable[256];
+	static glm::vec3 vertexInterpolation(float isoLevel, glm::vec3& p1, glm::vec3& p2, float valp1, float valp2);
+	static float interpolationFactor(float isoLevel, float valp1, float valp2); // Where between p1 (0) and p2 (1) the isoLevel is crossed
 
 };
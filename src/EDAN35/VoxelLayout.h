@@ -0,0 +1,42 @@
+#pragma once
+
+/// The orders TerrainGrid can store the voxels of a brick in, chosen at compile time with TERRAIN_VOXEL_LAYOUT.
+/// Every layout maps the voxel (x, y, z) of a brick of SIZE^3 voxels to its place in the brick, with (0, 0, 0) first.
+///
+/// Linear keeps rows along x together, so copying rows (as the meshing snapshots do) is a single copy per brick.
+/// LinearZ keeps rows along z together instead, which is the innermost loop of the sculpting brush.
+/// Morton interleaves the bits of x, y and z (Z-order), so that voxels close in any direction are close in memory.
+///
+namespace VoxelLayout {
+	struct Linear {
+		static const bool ROWS_CONTIGUOUS = true; // Whether the voxels along x are next to each other
+		static const char* getName() { return "linear"; }
+		template <int SIZE>
+		static int index(int x, int y, int z) { return (z * SIZE + y) * SIZE + x; }
+	};
+
+	struct LinearZ {
+		static const bool ROWS_CONTIGUOUS = false;
+		static const char* getName() { return "linear_z"; }
+		template <int SIZE>
+		static int index(int x, int y, int z) { return (x * SIZE + y) * SIZE + z; }
+	};
+
+	struct Morton {
+		static const bool ROWS_CONTIGUOUS = false;
+		static const char* getName() { return "morton"; }
+		template <int SIZE>
+		static int index(int x, int y, int z) {
+			// Only up to 8 voxels (3 bits) per axis
+			static_assert(SIZE <= 8, "Morton layout needs bricks of at most 8 voxels per axis");
+			return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+		}
+
+	private:
+		static int spread(int v) { return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4); } // Moves bit i to bit 3i
+	};
+}
+
+#ifndef TERRAIN_VOXEL_LAYOUT
+#define TERRAIN_VOXEL_LAYOUT VoxelLayout::Linear
+#endif
@@ -0,0 +1,108 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(int workerCount)
+	: job(nullptr), jobCount(0), nextJob(0), busyThreads(0), batch(0), stopping(false)
+{
+	startThreads(std::max(workerCount, 1) - 1); // The calling thread is a worker as well
+}
+
+WorkerPool::~WorkerPool() {
+	stopThreads();
+}
+
+void WorkerPool::parallelFor(int jobCount, const std::function<void(int)>& job) {
+	if (jobCount <= 0) return;
+
+	// Without background threads (or with a single job) there is nothing to gain from waking anyone up
+	if (threads.empty() || jobCount == 1) {
+		for (int i = 0; i < jobCount; i++) {
+			job(i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->job = &job;
+		this->jobCount = jobCount;
+		nextJob = 0;
+		busyThreads = static_cast<int>(threads.size());
+		batch++;
+	}
+	wakeCondition.notify_all();
+
+	// Help out with the jobs while the background threads are working
+	runJobs();
+
+	// Wait until the background threads are done as well, the job must stay alive until then
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [this]() { return busyThreads == 0; });
+	this->job = nullptr;
+}
+
+void WorkerPool::setWorkerCount(int count) {
+	count = std::max(count, 1);
+	if (count == getWorkerCount()) return;
+
+	stopThreads();
+	startThreads(count - 1);
+}
+
+int WorkerPool::getWorkerCount() const {
+	return static_cast<int>(threads.size()) + 1;
+}
+
+int WorkerPool::getMaxWorkerCount() {
+	// hardware_concurrency() is allowed to return 0 if it does not know
+	return std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+}
+
+void WorkerPool::startThreads(int count) {
+	stopping = false;
+	// Hand the current batch to the new threads right away, so that a batch started before they get
+	// to run is not mistaken for one they already finished
+	unsigned int currentBatch = batch;
+	for (int i = 0; i < count; i++) {
+		threads.emplace_back([this, currentBatch]() { workerLoop(currentBatch); });
+	}
+}
+
+void WorkerPool::stopThreads() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeCondition.notify_all();
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	threads.clear();
+}
+
+void WorkerPool::workerLoop(unsigned int lastBatch) {
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeCondition.wait(lock, [this, lastBatch]() { return stopping || batch != lastBatch; });
+			if (stopping) return;
+			lastBatch = batch;
+		}
+
+		runJobs();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busyThreads--;
+		}
+		doneCondition.notify_one();
+	}
+}
+
+void WorkerPool::runJobs() {
+	for (int i = nextJob++; i < jobCount; i = nextJob++) {
+		(*job)(i);
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A small pool of persistent worker threads used to split CPU heavy work (such as meshing) into independent jobs.
+/// The thread calling parallelFor() also works on the jobs, so a pool with a worker count of 1 runs everything inline.
+///
+class WorkerPool {
+public:
+	WorkerPool(int workerCount);
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	// Runs job(i) for every i in [0, jobCount) spread over all workers, and only returns once every job is done.
+	// Jobs are handed out in increasing order, but may finish in any order. Not meant to be called from several threads at once.
+	void parallelFor(int jobCount, const std::function<void(int)>& job);
+
+	void setWorkerCount(int count); // Sets the total amount of threads working on jobs (including the calling thread)
+	int getWorkerCount() const;
+	static int getMaxWorkerCount(); // The amount of hardware threads available on this machine
+
+private:
+	void startThreads(int count);
+	void stopThreads();
+	void workerLoop(unsigned int lastBatch);
+	void runJobs(); // Keeps taking jobs from the current batch until none are left
+
+	std::vector<std::thread> threads; // Background threads, the calling thread is not part of this list
+
+	std::mutex mutex;
+	std::condition_variable wakeCondition; // Signals the background threads that a new batch of jobs is available
+	std::condition_variable doneCondition; // Signals the calling thread that all background threads finished the batch
+
+	const std::function<void(int)>* job; // The job of the current batch
+	int jobCount; // The amount of jobs in the current batch
+	std::atomic<int> nextJob; // The next job index that has not been taken yet
+	int busyThreads; // Background threads still working on the current batch
+	unsigned int batch; // Incremented for every batch, so that the background threads know when there is new work
+	bool stopping;
+};
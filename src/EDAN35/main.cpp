@@ -21,6 +21,7 @@
 #include <cstdlib>
 #include <stdexcept>
 #include "DebugPointsRenderer.h"
+#include "SculptHistory.h"
 
 
 Project::ProjectWrapper::ProjectWrapper(WindowManager& windowManager) :
@@ -98,12 +99,22 @@ Project::ProjectWrapper::run()
 	if (triplanar_shader == 0u)
 		throw std::runtime_error("Failed to load triplanar_shader");
 
+	// Compute programs that generate the mesh on the GPU, only used (and loaded) with OpenGL 4.3
+	ComputeMesher::Programs compute_mesher_programs;
+	if (ComputeMesher::isSupported()) {
+		shader_manager.CreateAndRegisterComputeProgram("marching_cubes", "common/MarchingCubes.comp", compute_mesher_programs.marchingCubes);
+		shader_manager.CreateAndRegisterComputeProgram("marching_cubes_scan", "common/MarchingCubesScan.comp", compute_mesher_programs.scan);
+	}
+
 	shader_manager.ReloadAllPrograms();
 
 	// Create the TerrainGrid, and its renderers: TerrainMesh and DebugPointsRenderer
 	TerrainGrid* grid = new TerrainGrid(glm::ivec3(50), 1.0f);
-	TerrainMesh* mesh = new TerrainMesh(grid);
+	TerrainMesh* mesh = new TerrainMesh(grid, &compute_mesher_programs);
 	DebugPointsRenderer* debugPoints = new DebugPointsRenderer(grid);
+	// The undo and redo history of the sculpting, which records every stroke of the sculpting tool
+	SculptHistory* history = new SculptHistory(grid, 8 * 1024 * 1024);
+	grid->setHistory(history);
 
 	glClearDepthf(1.0f);
 	glClearColor(0.79, 0.91f, 0.96f, 1.0f); // Change the clear colour to make it a bit easier to see dark colours
@@ -116,7 +127,7 @@ Project::ProjectWrapper::run()
 	std::int32_t program_index = 0;
 
 	// Create the Config, which is used to manage the Scene Controls window
-	Config* config = new Config(grid, debugPoints, mesh);
+	Config* config = new Config(grid, debugPoints, mesh, history);
 	// Create the Sculpting Raycaster, which is used to cast sculpting rays
 	SculptingRaycaster* sculpter = new SculptingRaycaster(grid);
 	// Create the Crosshair object to render the crosshair
@@ -155,6 +166,17 @@ Project::ProjectWrapper::run()
 		if (inputHandler.GetKeycodeState(GLFW_KEY_X) & PRESSED) {
 			sculpter->cast(&mCamera, true, config->sculpter_size, config->sculpter_strength);
 		}
+		// A stroke lasts for as long as either sculpting key is held down
+		if (!(inputHandler.GetKeycodeState(GLFW_KEY_Z) & PRESSED) && !(inputHandler.GetKeycodeState(GLFW_KEY_X) & PRESSED)) {
+			history->endStroke();
+		}
+		if (inputHandler.GetKeycodeState(GLFW_KEY_U) & JUST_RELEASED)
+			history->undo();
+		if (inputHandler.GetKeycodeState(GLFW_KEY_R) & JUST_RELEASED)
+			history->redo();
+
+		// Hand all of the changes to the grid since the last frame (the sculpting above and the settings of the last frame) to the renderers at once
+		grid->flushChanges();
 
 		// Retrieve the actual framebuffer size: for HiDPI monitors,
 		// you might end up with a framebuffer larger than what you
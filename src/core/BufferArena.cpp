@@ -0,0 +1,205 @@
+#include "BufferArena.hpp"
+
+#include "Log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+namespace
+{
+	GLbitfield const persistent_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+}
+
+BufferArena::BufferArena(GLsizeiptr page_size) : page_size(page_size), used_size(0), persistent(GLAD_GL_VERSION_4_4 != 0)
+{
+}
+
+BufferArena::~BufferArena()
+{
+	for (auto const& retired : retired_ranges)
+		glDeleteSync(retired.fence);
+	// Deleting a buffer also unmaps it
+	for (auto const& page : pages)
+		glDeleteBuffers(1, &page.buffer);
+}
+
+BufferArena::Allocation BufferArena::Allocate(GLsizeiptr size, GLsizeiptr alignment)
+{
+	Allocation allocation;
+	if (size <= 0)
+		return allocation;
+
+	for (int page = 0; page < static_cast<int>(pages.size()); ++page)
+		if (AllocateFromPage(page, size, alignment, allocation))
+			return allocation;
+
+	// Out of space: try again with the ranges whose fences have passed in the meantime, before adding a new buffer
+	ReclaimPassedFences();
+	for (int page = 0; page < static_cast<int>(pages.size()); ++page)
+		if (AllocateFromPage(page, size, alignment, allocation))
+			return allocation;
+
+	AddPage(std::max(page_size, size + alignment));
+	AllocateFromPage(static_cast<int>(pages.size()) - 1, size, alignment, allocation);
+	return allocation;
+}
+
+void BufferArena::Free(Allocation& allocation)
+{
+	if (allocation.page >= 0)
+		freed_ranges.push_back(allocation);
+	allocation = Allocation();
+}
+
+void BufferArena::Retire()
+{
+	if (!freed_ranges.empty()) {
+		// The fence passes once every command issued so far, so every draw call that could still read the ranges, is done
+		RetiredRanges retired;
+		retired.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		retired.ranges.swap(freed_ranges);
+		retired_ranges.push_back(std::move(retired));
+	}
+	ReclaimPassedFences();
+}
+
+void BufferArena::Upload(Allocation const& allocation, void const* data, GLsizeiptr size)
+{
+	if (allocation.page < 0 || size <= 0)
+		return;
+
+	Page const& page = pages[allocation.page];
+	if (page.mapping != nullptr) {
+		std::memcpy(page.mapping + allocation.offset, data, static_cast<size_t>(size));
+		return;
+	}
+
+	// Bound to the copy target, to not disturb the vertex and index buffer bindings
+	glBindBuffer(GL_COPY_WRITE_BUFFER, page.buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, allocation.offset, size, data);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0u);
+}
+
+void* BufferArena::GetPointer(Allocation const& allocation) const
+{
+	if (allocation.page < 0 || pages[allocation.page].mapping == nullptr)
+		return nullptr;
+	return pages[allocation.page].mapping + allocation.offset;
+}
+
+GLuint BufferArena::GetBuffer(Allocation const& allocation) const
+{
+	return allocation.page >= 0 ? pages[allocation.page].buffer : 0u;
+}
+
+bool BufferArena::IsPersistentlyMapped() const
+{
+	return persistent;
+}
+
+GLsizeiptr BufferArena::GetUsedSize() const
+{
+	return used_size;
+}
+
+GLsizeiptr BufferArena::GetTotalSize() const
+{
+	GLsizeiptr total = 0;
+	for (auto const& page : pages)
+		total += page.size;
+	return total;
+}
+
+bool BufferArena::AllocateFromPage(int page_index, GLsizeiptr size, GLsizeiptr alignment, Allocation& allocation)
+{
+	auto& free_ranges = pages[page_index].free_ranges;
+
+	// First fit
+	for (auto range = free_ranges.begin(); range != free_ranges.end(); ++range) {
+		GLintptr const range_start = range->first;
+		GLintptr const range_end = range->first + range->second;
+		GLintptr const start = (range_start + alignment - 1) & ~static_cast<GLintptr>(alignment - 1);
+		if (start + size > range_end)
+			continue;
+
+		// Keep whatever is left on either side of the allocation
+		free_ranges.erase(range);
+		if (start > range_start)
+			free_ranges[range_start] = start - range_start;
+		if (start + size < range_end)
+			free_ranges[start + size] = range_end - (start + size);
+
+		allocation.page = page_index;
+		allocation.offset = start;
+		allocation.size = size;
+		used_size += size;
+		return true;
+	}
+	return false;
+}
+
+void BufferArena::AddPage(GLsizeiptr size)
+{
+	Page page;
+	page.size = size;
+	page.mapping = nullptr;
+	page.free_ranges[0] = size;
+
+	glGenBuffers(1, &page.buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, page.buffer);
+	if (persistent) {
+		// Dynamic storage keeps glBufferSubData working, in case the mapping fails
+		glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, persistent_flags | GL_DYNAMIC_STORAGE_BIT);
+		page.mapping = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, persistent_flags));
+		if (page.mapping == nullptr)
+			LogWarning("Persistently mapping a buffer of %d bytes failed, falling back to glBufferSubData.", static_cast<int>(size));
+	}
+	else {
+		glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0u);
+
+	pages.push_back(std::move(page));
+}
+
+void BufferArena::ReleaseRange(Allocation const& range)
+{
+	auto& free_ranges = pages[range.page].free_ranges;
+	GLintptr start = range.offset;
+	GLsizeiptr size = range.size;
+	used_size -= range.size;
+
+	// Merge with the free ranges right after and right before it
+	auto next = free_ranges.lower_bound(start);
+	if (next != free_ranges.end() && next->first == start + size) {
+		size += next->second;
+		next = free_ranges.erase(next);
+	}
+	if (next != free_ranges.begin()) {
+		auto previous = std::prev(next);
+		if (previous->first + previous->second == start) {
+			start = previous->first;
+			size += previous->second;
+			free_ranges.erase(previous);
+		}
+	}
+	free_ranges[start] = size;
+}
+
+void BufferArena::ReclaimPassedFences()
+{
+	// Fences pass in the order they were placed, so stop at the first one that has not
+	size_t passed = 0;
+	for (; passed < retired_ranges.size(); ++passed) {
+		GLenum const status = glClientWaitSync(retired_ranges[passed].fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+
+		glDeleteSync(retired_ranges[passed].fence);
+		for (auto const& range : retired_ranges[passed].ranges)
+			ReleaseRange(range);
+	}
+	retired_ranges.erase(retired_ranges.begin(), retired_ranges.begin() + passed);
+}
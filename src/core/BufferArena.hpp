@@ -0,0 +1,91 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <map>
+#include <vector>
+
+//! \brief Sub-allocates ranges of a few large OpenGL buffers, so that
+//!        updating some geometry does not have to create or resize any
+//!        buffer storage in the driver.
+//!
+//! With OpenGL 4.4, every buffer is created once with glBufferStorage and
+//! stays persistently mapped, so new data is simply copied (or directly
+//! generated) into the mapping. Without it, the buffers are allocated with
+//! glBufferData and updated with glBufferSubData instead.
+//!
+//! A freed range may still be read by draw calls the GPU has not executed
+//! yet, so it is only handed out again once a fence placed after those draw
+//! calls has passed: call Retire() after freeing ranges.
+//!
+//! The same buffer can be bound both as vertex and as index buffer.
+class BufferArena
+{
+public:
+	struct Allocation {
+		int page = -1; // Index of the buffer holding the range, -1 for an empty allocation
+		GLintptr offset = 0;
+		GLsizeiptr size = 0;
+	};
+
+	//! \param [in] page_size the size of every buffer created by the arena;
+	//!             bigger allocations get a buffer of their own
+	explicit BufferArena(GLsizeiptr page_size = 32 * 1024 * 1024);
+	~BufferArena();
+
+	BufferArena(BufferArena const&) = delete;
+	BufferArena& operator=(BufferArena const&) = delete;
+
+	//! \brief Allocate a range of size bytes, starting at a multiple of
+	//!        alignment (which has to be a power of two).
+	//!
+	//! An allocation of 0 bytes returns an empty allocation.
+	Allocation Allocate(GLsizeiptr size, GLsizeiptr alignment = 16);
+
+	//! \brief Give the range back to the arena, once the GPU is done with it.
+	//!
+	//! The allocation is reset to an empty allocation.
+	void Free(Allocation& allocation);
+
+	//! \brief Guard all ranges freed since the last call with a fence, and
+	//!        make the ranges of earlier fences that have passed available
+	//!        again. Never waits for the GPU.
+	void Retire();
+
+	//! \brief Copy size bytes of data to the start of the allocation.
+	void Upload(Allocation const& allocation, void const* data, GLsizeiptr size);
+
+	//! \brief The persistently mapped memory of the allocation, which can be
+	//!        written from any thread, or nullptr if the buffers are not
+	//!        persistently mapped (in which case use Upload()).
+	void* GetPointer(Allocation const& allocation) const;
+
+	GLuint GetBuffer(Allocation const& allocation) const;
+	bool IsPersistentlyMapped() const;
+	GLsizeiptr GetUsedSize() const; // The amount of bytes currently allocated or waiting to be retired
+	GLsizeiptr GetTotalSize() const; // The amount of bytes in all buffers
+
+private:
+	struct Page {
+		GLuint buffer;
+		unsigned char* mapping; // nullptr without persistent mapping
+		GLsizeiptr size;
+		std::map<GLintptr, GLsizeiptr> free_ranges; // Offset to size of every free range, never touching each other
+	};
+	struct RetiredRanges {
+		GLsync fence;
+		std::vector<Allocation> ranges;
+	};
+
+	bool AllocateFromPage(int page, GLsizeiptr size, GLsizeiptr alignment, Allocation& allocation);
+	void AddPage(GLsizeiptr size);
+	void ReleaseRange(Allocation const& range);
+	void ReclaimPassedFences();
+
+	GLsizeiptr page_size;
+	GLsizeiptr used_size;
+	bool persistent;
+	std::vector<Page> pages;
+	std::vector<Allocation> freed_ranges; // Freed since the last call to Retire()
+	std::vector<RetiredRanges> retired_ranges; // Waiting for their fence, oldest first
+};